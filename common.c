@@ -25,10 +25,12 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -48,28 +50,66 @@ gbm_bo_create_with_modifiers(struct gbm_device *gbm,
                              uint32_t format,
                              const uint64_t *modifiers,
                              const unsigned int count);
+WEAK struct gbm_surface *
+gbm_surface_create_with_modifiers2(struct gbm_device *gbm,
+                                   uint32_t width, uint32_t height,
+                                   uint32_t format,
+                                   const uint64_t *modifiers,
+                                   const unsigned int count,
+                                   uint32_t flags);
+WEAK struct gbm_bo *
+gbm_bo_create_with_modifiers2(struct gbm_device *gbm,
+                              uint32_t width, uint32_t height,
+                              uint32_t format,
+                              const uint64_t *modifiers,
+                              const unsigned int count,
+                              uint32_t flags);
+
+/* Without modifier support, buffers can still be created the old way as
+ * long as linear is one of the acceptable layouts:
+ */
+static bool allows_linear(const struct gbm *gbm)
+{
+	for (unsigned i = 0; i < gbm->num_modifiers; i++) {
+		if (gbm->modifiers[i] == DRM_FORMAT_MOD_LINEAR)
+			return true;
+	}
+
+	return false;
+}
 
-static struct gbm_bo * init_bo(uint64_t modifier)
+static struct gbm_bo * init_bo(struct gbm *gbm)
 {
 	struct gbm_bo *bo = NULL;
 
-	if (gbm_bo_create_with_modifiers) {
-		bo = gbm_bo_create_with_modifiers(gbm.dev,
-						  gbm.width, gbm.height,
-						  gbm.format,
-						  &modifier, 1);
+	/* the original entry point implies scanout usage, the newer one
+	 * lets offscreen buffers go without it:
+	 */
+	if (gbm_bo_create_with_modifiers2) {
+		bo = gbm_bo_create_with_modifiers2(gbm->dev,
+						   gbm->width, gbm->height,
+						   gbm->format,
+						   gbm->modifiers,
+						   gbm->num_modifiers,
+						   gbm->usage);
+	} else if (gbm_bo_create_with_modifiers) {
+		bo = gbm_bo_create_with_modifiers(gbm->dev,
+						  gbm->width, gbm->height,
+						  gbm->format,
+						  gbm->modifiers,
+						  gbm->num_modifiers);
 	}
 
 	if (!bo) {
-		if (modifier != DRM_FORMAT_MOD_LINEAR) {
+		if (!allows_linear(gbm)) {
 			fprintf(stderr, "Modifiers requested but support isn't available\n");
 			return NULL;
 		}
 
-		bo = gbm_bo_create(gbm.dev,
-				   gbm.width, gbm.height,
-				   gbm.format,
-				   GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+		bo = gbm_bo_create(gbm->dev,
+				   gbm->width, gbm->height,
+				   gbm->format,
+				   gbm->usage);
 	}
 
 	if (!bo) {
@@ -80,60 +120,113 @@ static struct gbm_bo * init_bo(uint64_t modifier)
 	return bo;
 }
 
-static struct gbm * init_surfaceless(uint64_t modifier)
+static struct gbm * init_surfaceless(struct gbm *gbm)
 {
-	for (unsigned i = 0; i < ARRAY_SIZE(gbm.bos); i++) {
-		gbm.bos[i] = init_bo(modifier);
-		if (!gbm.bos[i])
+	for (unsigned i = 0; i < gbm->num_buffers; i++) {
+		gbm->bos[i] = init_bo(gbm);
+		if (!gbm->bos[i])
 			return NULL;
 	}
-	return &gbm;
+	return gbm;
 }
 
-static struct gbm * init_surface(uint64_t modifier)
+static struct gbm * init_surface(struct gbm *gbm)
 {
-	if (gbm_surface_create_with_modifiers) {
-		gbm.surface = gbm_surface_create_with_modifiers(gbm.dev,
-								gbm.width, gbm.height,
-								gbm.format,
-								&modifier, 1);
+	if (gbm_surface_create_with_modifiers2) {
+		gbm->surface = gbm_surface_create_with_modifiers2(gbm->dev,
+								gbm->width, gbm->height,
+								gbm->format,
+								gbm->modifiers,
+								gbm->num_modifiers,
+								gbm->usage);
+	} else if (gbm_surface_create_with_modifiers) {
+		gbm->surface = gbm_surface_create_with_modifiers(gbm->dev,
+								gbm->width, gbm->height,
+								gbm->format,
+								gbm->modifiers,
+								gbm->num_modifiers);
 
 	}
 
-	if (!gbm.surface) {
-		if (modifier != DRM_FORMAT_MOD_LINEAR) {
+	if (!gbm->surface) {
+		if (!allows_linear(gbm)) {
 			fprintf(stderr, "Modifiers requested but support isn't available\n");
 			return NULL;
 		}
-		gbm.surface = gbm_surface_create(gbm.dev,
-						gbm.width, gbm.height,
-						gbm.format,
-						GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+		gbm->surface = gbm_surface_create(gbm->dev,
+						gbm->width, gbm->height,
+						gbm->format,
+						gbm->usage);
 
 	}
 
-	if (!gbm.surface) {
+	if (!gbm->surface) {
 		printf("failed to create gbm surface\n");
 		return NULL;
 	}
 
-	return &gbm;
+	return gbm;
 }
 
 const struct gbm * init_gbm(int drm_fd, int w, int h, uint32_t format,
-		uint64_t modifier, bool surfaceless)
+		const uint64_t *modifiers, unsigned num_modifiers,
+		bool surfaceless, bool scanout, unsigned num_buffers)
 {
 	gbm.dev = gbm_create_device(drm_fd);
 	gbm.format = format;
+	gbm.modifiers = modifiers;
+	gbm.num_modifiers = num_modifiers;
+	gbm.usage = GBM_BO_USE_RENDERING | (scanout ? GBM_BO_USE_SCANOUT : 0);
 	gbm.surface = NULL;
+	gbm.num_buffers = num_buffers;
 
 	gbm.width = w;
 	gbm.height = h;
 
 	if (surfaceless)
-		return init_surfaceless(modifier);
+		return init_surfaceless(&gbm);
 
-	return init_surface(modifier);
+	return init_surface(&gbm);
+}
+
+/* Buffers for an additional output of a different size, on the same
+ * device and with the same format and buffering as the primary one:
+ */
+const struct gbm * init_gbm_output(const struct gbm *primary, int w, int h)
+{
+	struct gbm *out = calloc(1, sizeof(*out));
+
+	if (!out)
+		return NULL;
+
+	out->dev = primary->dev;
+	out->format = primary->format;
+	out->modifiers = primary->modifiers;
+	out->num_modifiers = primary->num_modifiers;
+	out->usage = primary->usage;
+	out->num_buffers = primary->num_buffers;
+
+	out->width = w;
+	out->height = h;
+
+	if ((primary->surface ? init_surface(out) : init_surfaceless(out)) == NULL) {
+		free(out);
+		return NULL;
+	}
+
+	return out;
+}
+
+void fini_gbm(const struct gbm *gbm)
+{
+	if (gbm->surface) {
+		gbm_surface_destroy(gbm->surface);
+	} else {
+		for (unsigned i = 0; i < gbm->num_buffers; i++)
+			gbm_bo_destroy(gbm->bos[i]);
+	}
+
+	gbm_device_destroy(gbm->dev);
 }
 
 static bool has_ext(const char *extension_list, const char *ext)
@@ -356,6 +449,7 @@ int init_egl(struct egl *egl, const struct gbm *gbm, int samples)
 	get_proc_dpy(EGL_KHR_fence_sync, eglWaitSyncKHR);
 	get_proc_dpy(EGL_KHR_fence_sync, eglClientWaitSyncKHR);
 	get_proc_dpy(EGL_ANDROID_native_fence_sync, eglDupNativeFenceFDANDROID);
+	get_proc_dpy(EGL_EXT_image_dma_buf_import_modifiers, eglQueryDmaBufModifiersEXT);
 
 	egl->modifiers_supported = has_ext(egl_exts_dpy,
 					   "EGL_EXT_image_dma_buf_import_modifiers");
@@ -413,6 +507,13 @@ int init_egl(struct egl *egl, const struct gbm *gbm, int samples)
 	printf("===================================\n");
 
 	get_proc_gl(GL_OES_EGL_image, glEGLImageTargetTexture2DOES);
+	get_proc_gl(GL_OES_get_program_binary, glGetProgramBinaryOES);
+	get_proc_gl(GL_OES_get_program_binary, glProgramBinaryOES);
+	get_proc_gl(GL_KHR_parallel_shader_compile, glMaxShaderCompilerThreadsKHR);
+
+	/* let the driver use as many threads as it likes: */
+	if (egl->glMaxShaderCompilerThreadsKHR)
+		egl->glMaxShaderCompilerThreadsKHR(0xffffffff);
 
 	get_proc_gl(GL_AMD_performance_monitor, glGetPerfMonitorGroupsAMD);
 	get_proc_gl(GL_AMD_performance_monitor, glGetPerfMonitorCountersAMD);
@@ -426,8 +527,11 @@ int init_egl(struct egl *egl, const struct gbm *gbm, int samples)
 	get_proc_gl(GL_AMD_performance_monitor, glEndPerfMonitorAMD);
 	get_proc_gl(GL_AMD_performance_monitor, glGetPerfMonitorCounterDataAMD);
 
+	init_program_cache(egl);
+	startup_phase("egl");
+
 	if (!gbm->surface) {
-		for (unsigned i = 0; i < ARRAY_SIZE(gbm->bos); i++) {
+		for (unsigned i = 0; i < gbm->num_buffers; i++) {
 			if (!create_framebuffer(egl, gbm->bos[i], &egl->fbs[i])) {
 				printf("failed to create framebuffer\n");
 				return -1;
@@ -438,72 +542,143 @@ int init_egl(struct egl *egl, const struct gbm *gbm, int samples)
 	return 0;
 }
 
+/* Set up egl (a copy of the primary output's egl, sharing its display
+ * and context) to render to the buffers of an additional output:
+ */
+int init_egl_output(struct egl *egl, const struct gbm *gbm)
+{
+	if (!gbm->surface) {
+		egl->surface = EGL_NO_SURFACE;
+		for (unsigned i = 0; i < gbm->num_buffers; i++) {
+			if (!create_framebuffer(egl, gbm->bos[i], &egl->fbs[i])) {
+				printf("failed to create framebuffer\n");
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	egl->surface = eglCreateWindowSurface(egl->display, egl->config,
+			(EGLNativeWindowType)gbm->surface, NULL);
+	if (egl->surface == EGL_NO_SURFACE) {
+		printf("failed to create egl surface\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Destroying the context and terminating the display also frees the
+ * images, textures and framebuffers of the surfaceless case:
+ */
+void fini_egl(const struct egl *egl)
+{
+	eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			EGL_NO_CONTEXT);
+	if (egl->surface != EGL_NO_SURFACE)
+		eglDestroySurface(egl->display, egl->surface);
+	eglDestroyContext(egl->display, egl->context);
+	eglTerminate(egl->display);
+}
+
+/* Shaders are compiled and programs linked asynchronously: nothing
+ * waits for the driver until wait_program(), so with several programs to
+ * build, submit them all before waiting on the first, and the driver can
+ * work on them in parallel (with GL_KHR_parallel_shader_compile).  The
+ * status of the shaders is only checked if the link failed.
+ */
 int create_program(const char *vs_src, const char *fs_src)
 {
+	int64_t start_time = get_time_ns();
 	GLuint vertex_shader, fragment_shader, program;
-	GLint ret;
+
+	program = program_cache_load(vs_src, fs_src);
+	if (program) {
+		program_cache_time(get_time_ns() - start_time);
+		return program;
+	}
 
 	vertex_shader = glCreateShader(GL_VERTEX_SHADER);
 
 	glShaderSource(vertex_shader, 1, &vs_src, NULL);
 	glCompileShader(vertex_shader);
 
-	glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &ret);
-	if (!ret) {
-		char *log;
-
-		printf("vertex shader compilation failed!:\n");
-		glGetShaderiv(vertex_shader, GL_INFO_LOG_LENGTH, &ret);
-		if (ret > 1) {
-			log = malloc(ret);
-			glGetShaderInfoLog(vertex_shader, ret, NULL, log);
-			printf("%s", log);
-			free(log);
-		}
-
-		return -1;
-	}
-
 	fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
 
 	glShaderSource(fragment_shader, 1, &fs_src, NULL);
 	glCompileShader(fragment_shader);
 
-	glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &ret);
+	program = glCreateProgram();
+
+	glAttachShader(program, vertex_shader);
+	glAttachShader(program, fragment_shader);
+
+	program_cache_created(program);
+	program_cache_time(get_time_ns() - start_time);
+
+	return program;
+}
+
+void submit_program(unsigned program)
+{
+	int64_t start_time = get_time_ns();
+
+	/* binaries from the cache come linked: */
+	if (program_cache_loaded(program))
+		return;
+
+	glLinkProgram(program);
+
+	program_cache_time(get_time_ns() - start_time);
+}
+
+static bool check_shader(GLuint shader)
+{
+	GLint ret, type;
+
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ret);
 	if (!ret) {
 		char *log;
 
-		printf("fragment shader compilation failed!:\n");
-		glGetShaderiv(fragment_shader, GL_INFO_LOG_LENGTH, &ret);
+		glGetShaderiv(shader, GL_SHADER_TYPE, &type);
+		printf("%s shader compilation failed!:\n",
+			type == GL_VERTEX_SHADER ? "vertex" : "fragment");
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &ret);
 
 		if (ret > 1) {
 			log = malloc(ret);
-			glGetShaderInfoLog(fragment_shader, ret, NULL, log);
+			glGetShaderInfoLog(shader, ret, NULL, log);
 			printf("%s", log);
 			free(log);
 		}
 
-		return -1;
+		return false;
 	}
 
-	program = glCreateProgram();
-
-	glAttachShader(program, vertex_shader);
-	glAttachShader(program, fragment_shader);
-
-	return program;
+	return true;
 }
 
-int link_program(unsigned program)
+int wait_program(unsigned program)
 {
+	int64_t start_time = get_time_ns();
+	GLuint shaders[2];
+	GLsizei count = 0;
 	GLint ret;
 
-	glLinkProgram(program);
+	if (program_cache_loaded(program))
+		return 0;
 
 	glGetProgramiv(program, GL_LINK_STATUS, &ret);
 	if (!ret) {
 		char *log;
 
+		/* it's more useful to know why a shader didn't compile: */
+		glGetAttachedShaders(program, ARRAY_SIZE(shaders), &count, shaders);
+		for (GLsizei i = 0; i < count; i++) {
+			if (!check_shader(shaders[i]))
+				return -1;
+		}
+
 		printf("program linking failed!:\n");
 		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &ret);
 
@@ -517,9 +692,59 @@ int link_program(unsigned program)
 		return -1;
 	}
 
+	program_cache_store(program);
+	program_cache_time(get_time_ns() - start_time);
+
+	return 0;
+}
+
+int link_program(unsigned program)
+{
+	submit_program(program);
+	return wait_program(program);
+}
+
+static int make_dir(const char *path)
+{
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		printf("could not create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
 	return 0;
 }
 
+/* $XDG_CACHE_HOME/kmscube (or ~/.cache/kmscube), created if needed, or
+ * NULL if there is nowhere to cache things:
+ */
+const char * get_cache_dir(void)
+{
+	static char dir[PATH_MAX];
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char parent[PATH_MAX];
+
+	if (dir[0])
+		return dir;
+
+	if (xdg && xdg[0] == '/')
+		snprintf(parent, sizeof(parent), "%s", xdg);
+	else if (home)
+		snprintf(parent, sizeof(parent), "%s/.cache", home);
+	else
+		return NULL;
+
+	if (make_dir(parent))
+		return NULL;
+
+	snprintf(dir, sizeof(dir), "%s/kmscube", parent);
+	if (make_dir(dir)) {
+		dir[0] = '\0';
+		return NULL;
+	}
+
+	return dir;
+}
+
 int64_t get_time_ns(void)
 {
 	struct timespec tv;
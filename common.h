@@ -94,19 +94,30 @@ EGLAPI EGLSurface EGLAPIENTRY eglCreatePlatformPixmapSurfaceEXT (EGLDisplay dpy,
 #define EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT 0x3448
 #define EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT 0x3449
 #define EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT 0x344A
+typedef EGLBoolean (EGLAPIENTRYP PFNEGLQUERYDMABUFMODIFIERSEXTPROC) (EGLDisplay dpy, EGLint format, EGLint max_modifiers, EGLuint64KHR *modifiers, EGLBoolean *external_only, EGLint *num_modifiers);
 #endif
 
-#define NUM_BUFFERS 2
+/* swapchain depth, selectable at runtime with --buffers: */
+#define DEFAULT_NUM_BUFFERS 2
+#define MAX_NUM_BUFFERS 8
 
 struct gbm {
 	struct gbm_device *dev;
 	struct gbm_surface *surface;
-	struct gbm_bo *bos[NUM_BUFFERS];    /* for the surfaceless case */
+	struct gbm_bo *bos[MAX_NUM_BUFFERS];    /* for the surfaceless case */
+	unsigned num_buffers;
 	uint32_t format;
+	const uint64_t *modifiers;      /* acceptable ones, the driver picks */
+	unsigned num_modifiers;
+	uint32_t usage;                 /* GBM_BO_USE_* flags of the buffers */
 	int width, height;
 };
 
-const struct gbm * init_gbm(int drm_fd, int w, int h, uint32_t format, uint64_t modifier, bool surfaceless);
+const struct gbm * init_gbm(int drm_fd, int w, int h, uint32_t format,
+		const uint64_t *modifiers, unsigned num_modifiers,
+		bool surfaceless, bool scanout, unsigned num_buffers);
+const struct gbm * init_gbm_output(const struct gbm *primary, int w, int h);
+void fini_gbm(const struct gbm *gbm);
 
 struct framebuffer {
 	EGLImageKHR image;
@@ -119,17 +130,21 @@ struct egl {
 	EGLConfig config;
 	EGLContext context;
 	EGLSurface surface;
-	struct framebuffer fbs[NUM_BUFFERS];    /* for the surfaceless case */
+	struct framebuffer fbs[MAX_NUM_BUFFERS];    /* for the surfaceless case */
 
 	PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT;
 	PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
 	PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+	PFNGLGETPROGRAMBINARYOESPROC glGetProgramBinaryOES;
+	PFNGLPROGRAMBINARYOESPROC glProgramBinaryOES;
+	PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glMaxShaderCompilerThreadsKHR;
 	PFNEGLCREATESYNCKHRPROC eglCreateSyncKHR;
 	PFNEGLDESTROYSYNCKHRPROC eglDestroySyncKHR;
 	PFNEGLWAITSYNCKHRPROC eglWaitSyncKHR;
 	PFNEGLCLIENTWAITSYNCKHRPROC eglClientWaitSyncKHR;
 	PFNEGLDUPNATIVEFENCEFDANDROIDPROC eglDupNativeFenceFDANDROID;
+	PFNEGLQUERYDMABUFMODIFIERSEXTPROC eglQueryDmaBufModifiersEXT;
 
 	/* AMD_performance_monitor */
 	PFNGLGETPERFMONITORGROUPSAMDPROC         glGetPerfMonitorGroupsAMD;
@@ -161,9 +176,21 @@ static inline int __egl_check(void *ptr, const char *name)
 #define egl_check(egl, name) __egl_check((egl)->name, #name)
 
 int init_egl(struct egl *egl, const struct gbm *gbm, int samples);
+int init_egl_output(struct egl *egl, const struct gbm *gbm);
+void fini_egl(const struct egl *egl);
 int create_program(const char *vs_src, const char *fs_src);
+void submit_program(unsigned program);
+int wait_program(unsigned program);
 int link_program(unsigned program);
 
+void init_program_cache(const struct egl *egl);
+GLuint program_cache_load(const char *vs_src, const char *fs_src);
+void program_cache_created(GLuint program);
+bool program_cache_loaded(GLuint program);
+void program_cache_store(GLuint program);
+void program_cache_time(int64_t ns);
+void program_cache_report(void);
+
 enum mode {
 	SMOOTH,        /* smooth-shaded */
 	RGBA,          /* single-plane RGBA */
@@ -182,15 +209,18 @@ const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *shader
 struct decoder;
 struct decoder * video_init(const struct egl *egl, const struct gbm *gbm, const char *filename);
 EGLImage video_frame(struct decoder *dec);
+struct gbm_bo * video_frame_bo(struct decoder *dec);
+void video_release_bo(struct gbm_bo *bo);
 void video_deinit(struct decoder *dec);
 
-const struct egl * init_cube_video(const struct gbm *gbm, const char *video, int samples);
+const struct egl * init_cube_video(const struct gbm *gbm, const char *video, int samples,
+		bool video_plane);
 
 #else
 static inline const struct egl *
-init_cube_video(const struct gbm *gbm, const char *video, int samples)
+init_cube_video(const struct gbm *gbm, const char *video, int samples, bool video_plane)
 {
-	(void)gbm; (void)video; (void)samples;
+	(void)gbm; (void)video; (void)samples; (void)video_plane;
 	printf("no GStreamer support!\n");
 	return NULL;
 }
@@ -202,10 +232,58 @@ void end_perfcntrs(void);
 void finish_perfcntrs(void);
 void dump_perfcntrs(unsigned nframes, uint64_t elapsed_time_ns);
 
+enum stats_format {
+	STATS_TEXT,
+	STATS_JSON,
+	STATS_CSV,
+};
+
+struct stats_config {
+	enum stats_format format;
+
+	/* measuring starts once both this many frames were presented and
+	 * this much time went by since the first:
+	 */
+	unsigned warmup_frames;
+	int64_t warmup_ns;
+
+	/* the run is done after this many frames were measured (0 to not
+	 * stop), or once the coefficient of variation of the recent frame
+	 * times is below stop_cv (0 to not stop):
+	 */
+	unsigned frames;
+	double stop_cv;
+};
+
+struct stats;
+
+void init_stats(const struct stats_config *config);
+void stats_set_run(const char *fields);
+struct stats * stats_new(const char *name, unsigned vrefresh);
+void stats_free(struct stats *s);
+void stats_frame(struct stats *s, int64_t time_ns);
+void stats_missed(struct stats *s, unsigned n);
+bool stats_done(const struct stats *s);
+void stats_report(struct stats *s, int64_t time_ns, bool final);
+unsigned stats_frames(const struct stats *s);
+int64_t stats_elapsed(const struct stats *s, int64_t time_ns);
+
+void init_trace(const char *filename);
+void init_trace_thread(void);
+int64_t trace_begin(void);
+void trace_end(const char *name, int64_t begin);
+void trace_span(const char *name, int64_t begin, int64_t end);
+void finish_trace(void);
+
+void init_startup(void);
+void startup_phase(const char *name);
+void startup_report(void);
+
 #define NSEC_PER_SEC (INT64_C(1000) * USEC_PER_SEC)
 #define USEC_PER_SEC (INT64_C(1000) * MSEC_PER_SEC)
 #define MSEC_PER_SEC INT64_C(1000)
 
 int64_t get_time_ns(void);
+const char * get_cache_dir(void);
 
 #endif /* _COMMON_H */
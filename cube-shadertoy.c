@@ -252,15 +252,9 @@ static int load_shader(const char *file)
 	return create_program(shadertoy_vs, frag);
 }
 
-static int init_shadertoy(const char *file)
+/* the program is linked by init_cube_shadertoy(), alongside the cube's: */
+static int init_shadertoy(void)
 {
-	int ret = load_shader(file);
-	gl.stoy_program = ret;
-
-	glBindAttribLocation(gl.program, 0, "position");
-
-	ret = link_program(gl.stoy_program);
-
 	glUseProgram(gl.stoy_program);
 	gl.stoy_time_loc = glGetUniformLocation(gl.stoy_program, "iTime");
 
@@ -300,6 +294,13 @@ static int init_shadertoy(const char *file)
 static void draw_shadertoy(unsigned i)
 {
 	GLenum mrt_bufs[] = {GL_COLOR_ATTACHMENT0};
+	GLint viewport[4], fb;
+
+	/* the caller picks the framebuffer and viewport of the output being
+	 * drawn (which is not the default framebuffer when surfaceless):
+	 */
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &fb);
 
 	glBindFramebuffer(GL_FRAMEBUFFER, gl.stoy_fbo);
 	glViewport(0, 0, texw, texh);
@@ -321,8 +322,9 @@ static void draw_shadertoy(unsigned i)
 
 	glDisableVertexAttribArray(0);
 
-	/* switch back to back buffer: */
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	/* switch back to the output's buffer: */
+	glBindFramebuffer(GL_FRAMEBUFFER, fb);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
 }
 
 static void draw_cube_shadertoy(unsigned i)
@@ -331,7 +333,6 @@ static void draw_cube_shadertoy(unsigned i)
 
 	draw_shadertoy(i);
 
-	glViewport(0, 0, gl.gbm->width, gl.gbm->height);
 	glEnable(GL_CULL_FACE);
 
 	/* clear the color buffer */
@@ -419,8 +420,22 @@ const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *file,
 	glBindAttribLocation(gl.program, 1, "in_normal");
 	glBindAttribLocation(gl.program, 2, "in_color");
 
-	ret = link_program(gl.program);
-	if (ret)
+	submit_program(gl.program);
+
+	/* the shadertoy shader is the expensive one, get it going before
+	 * waiting for the cube's:
+	 */
+	ret = load_shader(file);
+	if (ret < 0)
+		return NULL;
+
+	gl.stoy_program = ret;
+
+	glBindAttribLocation(gl.stoy_program, 0, "position");
+
+	submit_program(gl.stoy_program);
+
+	if (wait_program(gl.program) || wait_program(gl.stoy_program))
 		return NULL;
 
 	glUseProgram(gl.program);
@@ -447,7 +462,7 @@ const struct egl * init_cube_shadertoy(const struct gbm *gbm, const char *file,
 	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)gl.normalsoffset);
 	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, (const GLvoid *)(intptr_t)gl.texcoordsoffset);
 
-	ret = init_shadertoy(file);
+	ret = init_shadertoy();
 	if (ret) {
 		printf("failed to initialize\n");
 		return NULL;
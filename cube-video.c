@@ -29,6 +29,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "drm-common.h"
 #include "esUtil.h"
 
 static struct {
@@ -51,6 +52,13 @@ static struct {
 	const char *filenames[32];
 
 	EGLSyncKHR last_fence;
+
+	/* scan the video out on a plane under the cube, rather than
+	 * blitting it as the background:
+	 */
+	bool video_plane;
+	struct layer *layer;
+	unsigned layer_frames;
 } gl;
 
 static const struct egl *egl = &gl.egl;
@@ -220,10 +228,60 @@ static const char *fragment_shader_source =
 		"}                                  \n";
 
 
+/* Put the current video frame on the layer under the cube.  Returns
+ * false if it has to be blitted instead:
+ */
+static bool update_video_plane(void)
+{
+	struct gbm_bo *bo = video_frame_bo(gl.decoder);
+
+	if (!bo)
+		return false;
+
+	if (!gl.layer) {
+		gl.layer = layer_new(bo, &(struct layer_config){
+			.w = gl.gbm->width,
+			.h = gl.gbm->height,
+			.zpos = -1,
+			.alpha = 0xffff,
+			.release = video_release_bo,
+		});
+		if (!gl.layer) {
+			video_release_bo(bo);
+			gl.video_plane = false;
+			return false;
+		}
+	} else {
+		layer_set_bo(gl.layer, bo);
+	}
+
+	/* the layer only goes on its plane with the next commit, which is
+	 * a few frames behind when rendering ahead; if it still isn't on
+	 * one by then, the display can't show it:
+	 */
+	if (layer_on_plane(gl.layer)) {
+		/* start counting afresh if it has to go through the test
+		 * again, after a size or format change or with the next file:
+		 */
+		gl.layer_frames = 0;
+		return true;
+	}
+
+	if (++gl.layer_frames > MAX_NUM_BUFFERS) {
+		printf("video can't be scanned out, blitting it instead\n");
+		layer_free(gl.layer);
+		gl.layer = NULL;
+		gl.video_plane = false;
+	}
+
+	return false;
+}
+
 static void draw_cube_video(unsigned i)
 {
 	ESMatrix modelview;
 	EGLImage frame;
+	bool on_plane;
 
 	if (gl.last_fence) {
 		egl->eglClientWaitSyncKHR(egl->display, gl.last_fence, 0, EGL_FOREVER_KHR);
@@ -241,6 +299,8 @@ static void draw_cube_video(unsigned i)
 		gl.decoder = video_init(&gl.egl, gl.gbm, gl.filenames[gl.idx]);
 	}
 
+	on_plane = gl.video_plane && frame && update_video_plane();
+
 	glUseProgram(gl.blit_program);
 
 	glActiveTexture(GL_TEXTURE0);
@@ -251,13 +311,19 @@ static void draw_cube_video(unsigned i)
 	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	egl->glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, frame);
 
-	/* clear the color buffer */
-	glClearColor(0.5, 0.5, 0.5, 1.0);
-	glClear(GL_COLOR_BUFFER_BIT);
-
-	glUseProgram(gl.blit_program);
-	glUniform1i(gl.blit_texture, 0); /* '0' refers to texture unit 0. */
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	if (on_plane) {
+		/* the video shows through wherever the cube isn't: */
+		glClearColor(0.0, 0.0, 0.0, 0.0);
+		glClear(GL_COLOR_BUFFER_BIT);
+	} else {
+		/* clear the color buffer */
+		glClearColor(0.5, 0.5, 0.5, 1.0);
+		glClear(GL_COLOR_BUFFER_BIT);
+
+		glUseProgram(gl.blit_program);
+		glUniform1i(gl.blit_texture, 0); /* '0' refers to texture unit 0. */
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
 
 	glUseProgram(gl.program);
 
@@ -301,7 +367,8 @@ static void draw_cube_video(unsigned i)
 	gl.last_fence = egl->eglCreateSyncKHR(egl->display, EGL_SYNC_FENCE_KHR, NULL);
 }
 
-const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames, int samples)
+const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames, int samples,
+		bool video_plane)
 {
 	char *fnames, *s;
 	int ret, i = 0;
@@ -334,6 +401,7 @@ const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames,
 
 	gl.aspect = (GLfloat)(gbm->height) / (GLfloat)(gbm->width);
 	gl.gbm = gbm;
+	gl.video_plane = video_plane;
 
 	ret = create_program(blit_vs, blit_fs);
 	if (ret < 0)
@@ -344,11 +412,8 @@ const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames,
 	glBindAttribLocation(gl.blit_program, 0, "in_position");
 	glBindAttribLocation(gl.blit_program, 1, "in_TexCoord");
 
-	ret = link_program(gl.blit_program);
-	if (ret)
-		return NULL;
-
-	gl.blit_texture = glGetUniformLocation(gl.blit_program, "uTex");
+	/* link both programs at once: */
+	submit_program(gl.blit_program);
 
 	ret = create_program(vertex_shader_source, fragment_shader_source);
 	if (ret < 0)
@@ -360,10 +425,13 @@ const struct egl * init_cube_video(const struct gbm *gbm, const char *filenames,
 	glBindAttribLocation(gl.program, 1, "in_TexCoord");
 	glBindAttribLocation(gl.program, 2, "in_normal");
 
-	ret = link_program(gl.program);
-	if (ret)
+	submit_program(gl.program);
+
+	if (wait_program(gl.blit_program) || wait_program(gl.program))
 		return NULL;
 
+	gl.blit_texture = glGetUniformLocation(gl.blit_program, "uTex");
+
 	gl.modelviewmatrix = glGetUniformLocation(gl.program, "modelviewMatrix");
 	gl.modelviewprojectionmatrix = glGetUniformLocation(gl.program, "modelviewprojectionMatrix");
 	gl.normalmatrix = glGetUniformLocation(gl.program, "normalMatrix");
@@ -23,323 +23,1414 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "drm-common.h"
 
-#define VOID2U64(x) ((uint64_t)(unsigned long)(x))
+/* from drm.h, for older libdrm: */
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
+/* from drm_mode.h, for older libdrm: */
+#ifndef FORMAT_BLOB_CURRENT
+struct drm_format_modifier_blob {
+	uint32_t version;
+	uint32_t flags;
+	uint32_t count_formats;
+	uint32_t formats_offset;
+	uint32_t count_modifiers;
+	uint32_t modifiers_offset;
+};
+
+struct drm_format_modifier {
+	uint64_t formats;
+	uint32_t offset;
+	uint32_t pad;
+	uint64_t modifier;
+};
+#endif
+
+WEAK uint64_t
+gbm_bo_get_modifier(struct gbm_bo *bo);
+
+/* connectors driven at once with --all-outputs: */
+#define MAX_OUTPUTS 8
+
+/* hardware plane layers, on top of (or under) the cube's plane: */
+#define MAX_LAYERS 4
+
+#define MAX_MODIFIERS 64
+
+static struct drm drm;
+
+/* modifiers every output's plane can scan out the format with: */
+static uint64_t modifiers[MAX_MODIFIERS];
+
+/* Property ids used by drm_atomic_commit(), looked up once at init time
+ * so that building a commit does not need to search props_info by name
+ * for every property of every frame:
+ */
+struct property_ids {
+	uint32_t connector_crtc_id;
+	uint32_t crtc_mode_id, crtc_active, crtc_out_fence_ptr;
+	uint32_t plane_fb_id, plane_crtc_id, plane_in_fence_fd;
+	uint32_t plane_src_x, plane_src_y, plane_src_w, plane_src_h;
+	uint32_t plane_crtc_x, plane_crtc_y, plane_crtc_w, plane_crtc_h;
+	uint32_t plane_zpos, plane_alpha;   /* 0 if missing or immutable */
+};
+
+/* A frame that has been rendered, and is waiting to be committed or is
+ * on screen:
+ */
+struct queued_frame {
+	struct gbm_bo *bo;
+	struct drm_fb *fb;
+	int slot;           /* index into gbm->bos[], -1 with a gbm surface */
+	int in_fence_fd;    /* signaled when the gpu is done rendering it */
+	int gpu_fence_fd;   /* same, kept to find out when that happened */
+	struct frame_times times;
+};
+
+/* Frames that are rendered but not committed yet are queued up in
+ * order, so with more than two buffers the gpu can keep rendering ahead
+ * while a flip is pending.  A buffer can be rendered into again as soon
+ * as the commit that replaced it on screen has been made, the gpu waits
+ * on the out-fence of that commit before touching it.
+ */
+struct swapchain {
+	struct queued_frame queue[MAX_NUM_BUFFERS];
+	unsigned head, count;
+
+	struct queued_frame front;     /* last committed frame */
+	bool has_front;
+
+	/* Async commits have no out-fence, so the frame they replace stays
+	 * busy until the flip event says it is off screen:
+	 */
+	struct queued_frame retired;
+	bool has_retired;
+
+	/* surfaceless: whether each buffer is queued or on screen, and the
+	 * out-fence of the commit that took it off screen:
+	 */
+	bool busy[MAX_NUM_BUFFERS];
+	int release_fence_fd[MAX_NUM_BUFFERS];
+	unsigned next_slot;
+
+	/* with a gbm surface we don't know which buffer gets rendered into
+	 * next, so wait for the latest commit that released one:
+	 */
+	int surface_release_fence_fd;
+
+	/* frames queued ahead of scanout, sampled as each frame starts: */
+	uint64_t in_flight_sum;
+	unsigned in_flight_max, in_flight_samples;
+
+	unsigned rendered, presented, dropped;
+};
+
+/* A connector, with the crtc and plane driving it, and everything needed
+ * to render and flip frames on it independently of the other outputs:
+ */
+struct output {
+	char name[32];
+	uint32_t connector_id, crtc_id;
+	int crtc_index;
+	drmModeModeInfo mode;
+
+	struct plane plane;
+	struct crtc crtc;
+	struct connector connector;
+	struct property_ids props;
+	uint64_t plane_zpos;   /* current zpos of the plane */
+
+	/* Request holding the plane state that does not change between
+	 * frames.  Each commit rewinds it to template_cursor and only
+	 * appends FB_ID and the fence properties (plus the modeset state
+	 * on the first commit):
+	 */
+	drmModeAtomicReq *template_req;
+	int template_cursor;
+	uint32_t mode_blob_id;
+
+	int kms_in_fence_fd;
+	int kms_out_fence_fd;
+
+	const struct gbm *gbm;
+	struct egl egl;        /* shares the display and context of the first */
+
+	uint32_t frame;        /* next frame to render */
+	uint32_t flags;        /* for the next commit */
+
+	/* set by drm_atomic_commit(), cleared by the flip event: */
+	bool flip_pending;
+	int64_t flip_time;
+
+	/* when the first commit was made, and whether it was a modeset: */
+	int64_t first_commit_time;
+	bool first_commit_modeset;
+
+	struct swapchain swapchain;
+
+	struct stats *stats;
+	struct jit *jit;
+	struct vblank *vblank;
+};
+
+static struct output outputs[MAX_OUTPUTS];
+static unsigned num_outputs;
+
+/* A buffer on a plane of its own, see layer_new(): */
+struct layer {
+	struct plane plane;
+	struct property_ids props;
+
+	struct layer_config config;
+	uint32_t fb_id;
+	uint32_t format, src_w, src_h;
+
+	/* latest bo set, the one in the pending commit, and on screen: */
+	struct gbm_bo *bo, *queued_bo, *front_bo;
 
-static struct drm drm = {
-	.kms_out_fence_fd = -1,
+	bool on_plane;     /* shown by the plane, rather than drawn by the gpu */
+	bool enabled;      /* plane enabled as of the last commit */
+	bool tested;       /* configuration checked since it last changed */
+	bool dirty;        /* changed since the last commit */
+	bool removed;      /* layer_free()'d, freed once the plane is off */
 };
 
-static int add_connector_property(drmModeAtomicReq *req, uint32_t obj_id,
-					const char *name, uint64_t value)
+static struct layer *layers[MAX_LAYERS];
+static unsigned num_layers;
+
+/* CPU time spent in drm_atomic_commit(): */
+static int64_t commit_time_ns;
+static unsigned commit_count;
+
+static uint32_t find_property(drmModeObjectProperties *obj_props,
+		drmModePropertyRes **props_info, const char *type, const char *name)
 {
-	struct connector *obj = drm.connector;
 	unsigned int i;
-	int prop_id = 0;
 
-	for (i = 0 ; i < obj->props->count_props ; i++) {
-		if (strcmp(obj->props_info[i]->name, name) == 0) {
-			prop_id = obj->props_info[i]->prop_id;
-			break;
+	for (i = 0 ; i < obj_props->count_props ; i++) {
+		if (strcmp(props_info[i]->name, name) == 0)
+			return props_info[i]->prop_id;
+	}
+
+	printf("no %s property: %s\n", type, name);
+	return 0;
+}
+
+/* For properties not every driver has, and that are only of use if
+ * they can be changed.  Returns 0 otherwise, and the current value:
+ */
+static uint32_t find_mutable_property(drmModeObjectProperties *obj_props,
+		drmModePropertyRes **props_info, const char *name, uint64_t *value)
+{
+	for (unsigned i = 0; i < obj_props->count_props; i++) {
+		if (strcmp(props_info[i]->name, name) != 0)
+			continue;
+
+		if (value)
+			*value = obj_props->prop_values[i];
+		if (props_info[i]->flags & DRM_MODE_PROP_IMMUTABLE)
+			return 0;
+		return props_info[i]->prop_id;
+	}
+
+	return 0;
+}
+
+static int init_plane_property_ids(struct plane *plane, struct property_ids *props)
+{
+#define get_prop_id(field, name) do {						\
+		props->field = find_property(plane->props,			\
+				plane->props_info, "plane", name);		\
+		if (!props->field)						\
+			return -1;						\
+	} while (0)
+
+	get_prop_id(plane_fb_id, "FB_ID");
+	get_prop_id(plane_crtc_id, "CRTC_ID");
+	get_prop_id(plane_in_fence_fd, "IN_FENCE_FD");
+	get_prop_id(plane_src_x, "SRC_X");
+	get_prop_id(plane_src_y, "SRC_Y");
+	get_prop_id(plane_src_w, "SRC_W");
+	get_prop_id(plane_src_h, "SRC_H");
+	get_prop_id(plane_crtc_x, "CRTC_X");
+	get_prop_id(plane_crtc_y, "CRTC_Y");
+	get_prop_id(plane_crtc_w, "CRTC_W");
+	get_prop_id(plane_crtc_h, "CRTC_H");
+
+#undef get_prop_id
+
+	props->plane_zpos = find_mutable_property(plane->props,
+			plane->props_info, "zpos", NULL);
+	props->plane_alpha = find_mutable_property(plane->props,
+			plane->props_info, "alpha", NULL);
+
+	return 0;
+}
+
+static int init_property_ids(struct output *o)
+{
+#define get_prop_id(type, field, name) do {					\
+		o->props.field = find_property(o->type.props,			\
+				o->type.props_info, #type, name);		\
+		if (!o->props.field)						\
+			return -1;						\
+	} while (0)
+
+	get_prop_id(connector, connector_crtc_id, "CRTC_ID");
+	get_prop_id(crtc, crtc_mode_id, "MODE_ID");
+	get_prop_id(crtc, crtc_active, "ACTIVE");
+	get_prop_id(crtc, crtc_out_fence_ptr, "OUT_FENCE_PTR");
+
+#undef get_prop_id
+
+	/* the layers are stacked around the primary plane's zpos: */
+	find_mutable_property(o->plane.props, o->plane.props_info, "zpos",
+			&o->plane_zpos);
+
+	return init_plane_property_ids(&o->plane, &o->props);
+}
+
+static int init_commit_template(struct output *o)
+{
+	uint32_t plane_id = o->plane.plane->plane_id;
+	int ret = 0;
+
+	o->template_req = drmModeAtomicAlloc();
+	if (!o->template_req)
+		return -1;
+
+#define add_plane_property(prop, value) \
+		ret |= drmModeAtomicAddProperty(o->template_req, plane_id, o->props.prop, value) < 0
+
+	add_plane_property(plane_crtc_id, o->crtc_id);
+	add_plane_property(plane_src_x, 0);
+	add_plane_property(plane_src_y, 0);
+	add_plane_property(plane_src_w, o->mode.hdisplay << 16);
+	add_plane_property(plane_src_h, o->mode.vdisplay << 16);
+	add_plane_property(plane_crtc_x, 0);
+	add_plane_property(plane_crtc_y, 0);
+	add_plane_property(plane_crtc_w, o->mode.hdisplay);
+	add_plane_property(plane_crtc_h, o->mode.vdisplay);
+
+#undef add_plane_property
+
+	if (ret) {
+		drmModeAtomicFree(o->template_req);
+		o->template_req = NULL;
+		return -1;
+	}
+
+	o->template_cursor = drmModeAtomicGetCursor(o->template_req);
+
+	return 0;
+}
+
+static int add_modeset_properties(struct output *o, drmModeAtomicReq *req)
+{
+	if (!o->mode_blob_id &&
+	    drmModeCreatePropertyBlob(drm.fd, &o->mode, sizeof(o->mode),
+				      &o->mode_blob_id) != 0)
+		return -1;
+
+	if (drmModeAtomicAddProperty(req, o->connector_id,
+			o->props.connector_crtc_id, o->crtc_id) < 0)
+		return -1;
+
+	if (drmModeAtomicAddProperty(req, o->crtc_id,
+			o->props.crtc_mode_id, o->mode_blob_id) < 0)
+		return -1;
+
+	if (drmModeAtomicAddProperty(req, o->crtc_id,
+			o->props.crtc_active, 1) < 0)
+		return -1;
+
+	return 0;
+}
+
+static bool layers_dirty(const struct output *o)
+{
+	if (o != &outputs[0])
+		return false;
+
+	for (unsigned n = 0; n < num_layers; n++) {
+		if (layers[n]->dirty)
+			return true;
+	}
+
+	return false;
+}
+
+/* Position of a layer in the stack, counting away from the cube's plane
+ * on its side (0 is right next to it).  Ties go by order of creation:
+ */
+static int layer_rank(unsigned idx)
+{
+	const struct layer *l = layers[idx];
+	bool above = l->config.zpos >= 0;
+	int rank = 0;
+
+	for (unsigned n = 0; n < num_layers; n++) {
+		const struct layer *m = layers[n];
+
+		if (n == idx || !m->on_plane || (m->config.zpos >= 0) != above)
+			continue;
+
+		if (above ? m->config.zpos < l->config.zpos : m->config.zpos > l->config.zpos)
+			rank++;
+		else if (m->config.zpos == l->config.zpos && n < idx)
+			rank++;
+	}
+
+	return rank;
+}
+
+/* Add the state of all layers to req.  Layers get absolute zpos values
+ * around the cube's plane, which is moved up to make room for those
+ * below it when its zpos can be changed:
+ */
+static void add_layer_properties(struct output *o, drmModeAtomicReq *req)
+{
+	int64_t primary_zpos = o->plane_zpos;
+
+	if (o->props.plane_zpos) {
+		primary_zpos = 0;
+		for (unsigned n = 0; n < num_layers; n++)
+			primary_zpos += layers[n]->on_plane && layers[n]->config.zpos < 0;
+		drmModeAtomicAddProperty(req, o->plane.plane->plane_id,
+				o->props.plane_zpos, primary_zpos);
+	}
+
+	for (unsigned n = 0; n < num_layers; n++) {
+		struct layer *l = layers[n];
+		uint32_t plane_id = l->plane.plane->plane_id;
+		int rank = layer_rank(n);
+
+		if (!l->on_plane) {
+			if (l->enabled) {
+				drmModeAtomicAddProperty(req, plane_id, l->props.plane_fb_id, 0);
+				drmModeAtomicAddProperty(req, plane_id, l->props.plane_crtc_id, 0);
+			}
+			continue;
 		}
+
+#define add_layer_property(prop, value) \
+		drmModeAtomicAddProperty(req, plane_id, l->props.prop, value)
+
+		add_layer_property(plane_fb_id, l->fb_id);
+		add_layer_property(plane_crtc_id, o->crtc_id);
+		add_layer_property(plane_src_x, 0);
+		add_layer_property(plane_src_y, 0);
+		add_layer_property(plane_src_w, l->src_w << 16);
+		add_layer_property(plane_src_h, l->src_h << 16);
+		add_layer_property(plane_crtc_x, l->config.x);
+		add_layer_property(plane_crtc_y, l->config.y);
+		add_layer_property(plane_crtc_w, l->config.w ? l->config.w : l->src_w);
+		add_layer_property(plane_crtc_h, l->config.h ? l->config.h : l->src_h);
+		if (l->props.plane_alpha)
+			add_layer_property(plane_alpha, l->config.alpha);
+		if (l->props.plane_zpos)
+			add_layer_property(plane_zpos, l->config.zpos < 0 ?
+					primary_zpos - 1 - rank : primary_zpos + 1 + rank);
+
+#undef add_layer_property
 	}
+}
+
+/* Check the layers whose configuration changed with test-only commits,
+ * one at a time on top of those already on planes, and leave the ones
+ * that don't pass to the gpu:
+ */
+static void test_layers(struct output *o, uint32_t fb_id, uint32_t flags)
+{
+	uint32_t test_flags = DRM_MODE_ATOMIC_TEST_ONLY |
+			(flags & DRM_MODE_ATOMIC_ALLOW_MODESET);
 
-	if (prop_id < 0) {
-		printf("no connector property: %s\n", name);
-		return -EINVAL;
+	for (unsigned n = 0; n < num_layers; n++) {
+		if (!layers[n]->tested)
+			layers[n]->on_plane = false;
 	}
 
-	return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+	for (unsigned n = 0; n < num_layers; n++) {
+		struct layer *l = layers[n];
+		drmModeAtomicReq *req;
+		int ret = -1;
+
+		if (l->tested)
+			continue;
+		l->tested = true;
+
+		if (l->removed || !l->fb_id)
+			continue;
+
+		/* the template is rewound, so this is just the fixed state: */
+		req = drmModeAtomicDuplicate(o->template_req);
+		if (!req)
+			continue;
+
+		l->on_plane = true;
+		if (!(flags & DRM_MODE_ATOMIC_ALLOW_MODESET) ||
+		    add_modeset_properties(o, req) == 0) {
+			drmModeAtomicAddProperty(req, o->plane.plane->plane_id,
+					o->props.plane_fb_id, fb_id);
+			add_layer_properties(o, req);
+			ret = drmModeAtomicCommit(drm.fd, req, test_flags, NULL);
+		}
+		drmModeAtomicFree(req);
+
+		if (ret) {
+			printf("plane %u can't show layer (%s), drawing it on the gpu\n",
+					l->plane.plane->plane_id, strerror(errno));
+			l->on_plane = false;
+		}
+	}
 }
 
-static int add_crtc_property(drmModeAtomicReq *req, uint32_t obj_id,
-				const char *name, uint64_t value)
+static void free_layer(struct layer *l)
 {
-	struct crtc *obj = drm.crtc;
-	unsigned int i;
-	int prop_id = -1;
+	for (unsigned i = 0; i < l->plane.props->count_props; i++)
+		drmModeFreeProperty(l->plane.props_info[i]);
+	free(l->plane.props_info);
+	drmModeFreeObjectProperties(l->plane.props);
+	drmModeFreePlane(l->plane.plane);
+	free(l);
+}
+
+static void release_layer_bo(struct layer *l, struct gbm_bo *bo)
+{
+	if (bo && l->config.release)
+		l->config.release(bo);
+}
+
+/* the layer changes went out, forget about them: */
+static void layers_committed(void)
+{
+	for (unsigned n = 0; n < num_layers; n++) {
+		struct layer *l = layers[n];
+
+		l->enabled = l->on_plane;
+		l->queued_bo = l->on_plane ? l->bo : NULL;
+		l->dirty = false;
+	}
+}
+
+/* A flip on the layers' output completed: the layer bos of its commit
+ * are on screen now, and the ones they replaced can go.  So can layers
+ * whose plane has been turned off:
+ */
+static void layers_flipped(void)
+{
+	unsigned kept = 0;
+
+	for (unsigned n = 0; n < num_layers; n++) {
+		struct layer *l = layers[n];
+
+		if (l->front_bo != l->queued_bo) {
+			release_layer_bo(l, l->front_bo);
+			l->front_bo = l->queued_bo;
+		}
+
+		if (l->removed && !l->enabled && !l->front_bo)
+			free_layer(l);
+		else
+			layers[kept++] = l;
+	}
+
+	num_layers = kept;
+}
+
+static int drm_atomic_commit(struct output *o, uint32_t fb_id, uint32_t flags)
+{
+	drmModeAtomicReq *req = o->template_req;
+	uint32_t plane_id = o->plane.plane->plane_id;
+	int64_t start_time = get_time_ns();
+	bool update_layers = layers_dirty(o);
+	int ret;
+
+	/* drop whatever the previous commit appended to the template: */
+	drmModeAtomicSetCursor(req, o->template_cursor);
+
+	if (update_layers) {
+		test_layers(o, fb_id, flags);
+
+		/* async flips can only change the FB_ID of one plane: */
+		flags &= ~DRM_MODE_PAGE_FLIP_ASYNC;
+	}
+
+	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+		if (add_modeset_properties(o, req))
+			return -1;
+	}
+
+	drmModeAtomicAddProperty(req, plane_id, o->props.plane_fb_id, fb_id);
+
+	if (update_layers)
+		add_layer_properties(o, req);
+
+	if (o->kms_in_fence_fd != -1) {
+		/* async flips may only change FB_ID (and the in-fence), and
+		 * complete right away anyway, so there is no out-fence:
+		 */
+		if (!(flags & DRM_MODE_PAGE_FLIP_ASYNC))
+			drmModeAtomicAddProperty(req, o->crtc_id, o->props.crtc_out_fence_ptr,
+					VOID2U64(&o->kms_out_fence_fd));
+		drmModeAtomicAddProperty(req, plane_id, o->props.plane_in_fence_fd,
+				o->kms_in_fence_fd);
+	}
+
+	int64_t t = trace_begin();
+	ret = drmModeAtomicCommit(drm.fd, req, flags, o);
+	trace_end("drmModeAtomicCommit", t);
+	if (ret)
+		return ret;
+
+	if (o->kms_in_fence_fd != -1) {
+		close(o->kms_in_fence_fd);
+		o->kms_in_fence_fd = -1;
+	}
+
+	if (update_layers)
+		layers_committed();
+
+	commit_time_ns += get_time_ns() - start_time;
+	commit_count++;
+
+	return 0;
+}
+
+static EGLSyncKHR create_fence(const struct egl *egl, int fd)
+{
+	EGLint attrib_list[] = {
+		EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fd,
+		EGL_NONE,
+	};
+	EGLSyncKHR fence = egl->eglCreateSyncKHR(egl->display,
+			EGL_SYNC_NATIVE_FENCE_ANDROID, attrib_list);
+	assert(fence);
+	return fence;
+}
+
+/* Hand the buffer of a frame that is (or is about to go) off screen back
+ * to be rendered into, once fence_fd signals (-1 for right away):
+ */
+static void release_frame(struct output *o, const struct queued_frame *qf,
+		int fence_fd)
+{
+	struct swapchain *sc = &o->swapchain;
+
+	if (o->gbm->surface) {
+		gbm_surface_release_buffer(o->gbm->surface, qf->bo);
+		if (sc->surface_release_fence_fd != -1)
+			close(sc->surface_release_fence_fd);
+		sc->surface_release_fence_fd = fence_fd;
+	} else {
+		sc->busy[qf->slot] = false;
+		sc->release_fence_fd[qf->slot] = fence_fd;
+	}
+}
+
+static void page_flip_handler(int fd, unsigned int frame,
+		  unsigned int sec, unsigned int usec, void *data)
+{
+	struct output *o = data;
+	struct queued_frame *front = &o->swapchain.front;
+	int64_t now = get_time_ns();
+	int64_t timestamp = sec * NSEC_PER_SEC + usec * (NSEC_PER_SEC / USEC_PER_SEC);
+
+	/* suppress 'unused parameter' warnings */
+	(void)fd;
+
+	o->flip_pending = false;
+	o->swapchain.presented++;
+
+	if (o->swapchain.has_retired) {
+		release_frame(o, &o->swapchain.retired, -1);
+		o->swapchain.has_retired = false;
+	}
+
+	if (o == &outputs[0]) {
+		layers_flipped();
+		if (o->swapchain.presented == 1) {
+			startup_phase("first frame");
+			startup_report();
+		}
+	}
+
+	if (o->swapchain.presented == 1)
+		printf("First commit on %s (%s) took %.1f ms to show up\n",
+			o->name, o->first_commit_modeset ? "modeset" : "no modeset",
+			(double)(now - o->first_commit_time) / (NSEC_PER_SEC / MSEC_PER_SEC));
+
+	/* the frame that just went on screen is the last one committed: */
+	front->times.gpu_done = sync_file_signal_time(front->gpu_fence_fd);
+	close(front->gpu_fence_fd);
+	front->gpu_fence_fd = -1;
+
+	jit_frame_done(o->jit, front->times.render_start, front->times.gpu_done, timestamp);
+	jit_vblank(o->jit, timestamp);
+
+	/* async flips don't wait for a vblank, so they can't miss one: */
+	if (drm.present != PRESENT_ASYNC)
+		stats_missed(o->stats, vblank_flip(o->vblank, frame, timestamp, &front->times));
+
+	stats_frame(o->stats, now);
+	trace_span("page flip", o->flip_time, now);
+}
+
+static void init_swapchain(struct swapchain *sc)
+{
+	memset(sc, 0, sizeof(*sc));
+	for (unsigned n = 0; n < MAX_NUM_BUFFERS; n++)
+		sc->release_fence_fd[n] = -1;
+	sc->surface_release_fence_fd = -1;
+}
+
+/* the buffers themselves belong to the gbm surface or device: */
+static void fini_swapchain(struct swapchain *sc)
+{
+	for (unsigned n = 0; n < MAX_NUM_BUFFERS; n++) {
+		if (sc->release_fence_fd[n] != -1)
+			close(sc->release_fence_fd[n]);
+	}
+	if (sc->surface_release_fence_fd != -1)
+		close(sc->surface_release_fence_fd);
+	init_swapchain(sc);
+}
+
+static bool can_render(const struct output *o)
+{
+	const struct gbm *gbm = o->gbm;
+
+	/* one buffer always stays on screen (or on its way there), and
+	 * the one an async flip replaces until the flip completes:
+	 */
+	if (o->swapchain.count + 1 + o->swapchain.has_retired >= gbm->num_buffers)
+		return false;
+
+	if (gbm->surface && !gbm_surface_has_free_buffers(gbm->surface))
+		return false;
+
+	return true;
+}
+
+static int get_free_slot(struct output *o)
+{
+	struct swapchain *sc = &o->swapchain;
+
+	for (unsigned n = 0; n < o->gbm->num_buffers; n++) {
+		unsigned slot = (sc->next_slot + n) % o->gbm->num_buffers;
+
+		if (!sc->busy[slot]) {
+			sc->next_slot = slot + 1;
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+static int render_frame(struct output *o, struct queued_frame *qf)
+{
+	const struct gbm *gbm = o->gbm;
+	const struct egl *egl = &o->egl;
+	struct swapchain *sc = &o->swapchain;
+	EGLSyncKHR gpu_fence = NULL;   /* out-fence from gpu, in-fence to kms */
+	EGLSyncKHR kms_fence = NULL;   /* in-fence to gpu, out-fence from kms */
+	int *release_fence_fd;
+	int64_t t;
+
+	if (gbm->surface) {
+		qf->slot = -1;
+		release_fence_fd = &sc->surface_release_fence_fd;
+	} else {
+		qf->slot = get_free_slot(o);
+		assert(qf->slot >= 0);
+		sc->busy[qf->slot] = true;
+		release_fence_fd = &sc->release_fence_fd[qf->slot];
+	}
+
+	/* all outputs share one context, which needs to be pointed at the
+	 * surface of the output being drawn:
+	 */
+	if (num_outputs > 1) {
+		if (gbm->surface)
+			eglMakeCurrent(egl->display, egl->surface, egl->surface, egl->context);
+		glViewport(0, 0, gbm->width, gbm->height);
+	}
+
+	if (*release_fence_fd != -1) {
+		kms_fence = create_fence(egl, *release_fence_fd);
+		assert(kms_fence);
+
+		/* driver now has ownership of the fence fd: */
+		*release_fence_fd = -1;
+
+		/* wait "on the gpu" (ie. this won't necessarily block, but
+		 * will block the rendering until fence is signaled), until
+		 * the pageflip that replaced this buffer completes so we
+		 * don't render into a buffer that is still on screen.
+		 */
+		egl->eglWaitSyncKHR(egl->display, kms_fence, 0);
+		egl->eglDestroySyncKHR(egl->display, kms_fence);
+	}
+
+	if (!gbm->surface) {
+		glBindFramebuffer(GL_FRAMEBUFFER, egl->fbs[qf->slot].fb);
+	}
+
+	qf->times = (struct frame_times){
+		.frame = o->frame,
+		.render_start = get_time_ns(),
+	};
+	t = trace_begin();
+	egl->draw(o->frame++);
+	trace_end("draw", t);
+
+	/* insert fence to be singled in cmdstream.. this fence will be
+	 * signaled when gpu rendering done
+	 */
+	gpu_fence = create_fence(egl, EGL_NO_NATIVE_FENCE_FD_ANDROID);
+	assert(gpu_fence);
+
+	if (gbm->surface) {
+		t = trace_begin();
+		eglSwapBuffers(egl->display, egl->surface);
+		trace_end("eglSwapBuffers", t);
+	}
 
-	for (i = 0 ; i < obj->props->count_props ; i++) {
-		if (strcmp(obj->props_info[i]->name, name) == 0) {
-			prop_id = obj->props_info[i]->prop_id;
+	/* after swapbuffers, gpu_fence should be flushed, so safe
+	 * to get fd:
+	 */
+	qf->in_fence_fd = egl->eglDupNativeFenceFDANDROID(egl->display, gpu_fence);
+	egl->eglDestroySyncKHR(egl->display, gpu_fence);
+	assert(qf->in_fence_fd != -1);
+	qf->gpu_fence_fd = dup(qf->in_fence_fd);
+
+	if (gbm->surface) {
+		t = trace_begin();
+		qf->bo = gbm_surface_lock_front_buffer(gbm->surface);
+		trace_end("gbm_surface_lock_front_buffer", t);
+	} else {
+		qf->bo = gbm->bos[qf->slot];
+	}
+	if (!qf->bo) {
+		printf("Failed to lock frontbuffer\n");
+		return -1;
+	}
+	t = trace_begin();
+	qf->fb = drm_fb_get_from_bo(qf->bo);
+	trace_end("drm_fb_get_from_bo", t);
+	if (!qf->fb) {
+		printf("Failed to get a new framebuffer BO\n");
+		return -1;
+	}
+
+	qf->times.draw_done = get_time_ns();
+
+	if (qf->times.frame == 0 && gbm_bo_get_modifier)
+		printf("%s: scanning out with modifier 0x%016" PRIx64 "\n",
+				o->name, gbm_bo_get_modifier(qf->bo));
+
+	return 0;
+}
+
+/* Throw away the oldest queued frame without showing it: */
+static void drop_frame(struct output *o)
+{
+	struct swapchain *sc = &o->swapchain;
+	struct queued_frame *qf = &sc->queue[sc->head];
+
+	/* the buffer was never scanned out, so there is no release fence
+	 * to wait for, and the gpu finishes rendering it before anything
+	 * else is rendered into it:
+	 */
+	close(qf->in_fence_fd);
+	close(qf->gpu_fence_fd);
+	if (o->gbm->surface)
+		gbm_surface_release_buffer(o->gbm->surface, qf->bo);
+	else
+		sc->busy[qf->slot] = false;
+
+	sc->head = (sc->head + 1) % MAX_NUM_BUFFERS;
+	sc->count--;
+	sc->dropped++;
+}
+
+static bool fence_signaled(int fd)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/* Mailbox: drop the queued frames that are older than the newest one
+ * the gpu has finished.  If none is finished yet, the oldest one is
+ * kept, as that is the first to complete.  Newer, still rendering,
+ * frames stay queued for the next flip.
+ */
+static void drop_stale_frames(struct output *o)
+{
+	struct swapchain *sc = &o->swapchain;
+	unsigned keep = 0;
+
+	for (unsigned n = sc->count; n-- > 1; ) {
+		struct queued_frame *qf =
+			&sc->queue[(sc->head + n) % MAX_NUM_BUFFERS];
+
+		if (fence_signaled(qf->in_fence_fd)) {
+			keep = n;
 			break;
 		}
 	}
 
-	if (prop_id < 0) {
-		printf("no crtc property: %s\n", name);
-		return -EINVAL;
+	while (keep--)
+		drop_frame(o);
+}
+
+/* Commit the oldest queued frame (or with mailbox, the newest finished): */
+static int commit_frame(struct output *o)
+{
+	struct swapchain *sc = &o->swapchain;
+	uint32_t flags = o->flags;
+	struct queued_frame *qf;
+	int ret;
+
+	if (drm.present == PRESENT_MAILBOX)
+		drop_stale_frames(o);
+
+	qf = &sc->queue[sc->head];
+
+	o->kms_in_fence_fd = qf->in_fence_fd;
+
+	/* the first commit (which may be a modeset) can't be async: */
+	if (drm.present == PRESENT_ASYNC && o->first_commit_time)
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+
+	/* layers changed since the last frame go out with this commit: */
+	qf->times.commit = get_time_ns();
+	o->flip_time = trace_begin();
+	ret = drm_atomic_commit(o, qf->fb->fb_id, flags);
+	if (ret && (flags & DRM_MODE_PAGE_FLIP_ASYNC)) {
+		/* drivers can reject async flips depending on the plane
+		 * configuration, even when they support them in general:
+		 */
+		printf("async page flip failed (%s), falling back to vsync\n",
+				strerror(errno));
+		drm.present = PRESENT_FIFO;
+		flags &= ~DRM_MODE_PAGE_FLIP_ASYNC;
+		ret = drm_atomic_commit(o, qf->fb->fb_id, flags);
+	}
+	if (ret && !o->first_commit_time &&
+	    !(flags & DRM_MODE_ATOMIC_ALLOW_MODESET)) {
+		/* the mode matched, but something else about the state the
+		 * crtc was left in needs a modeset after all:
+		 */
+		printf("flip without modeset failed (%s), doing a modeset\n",
+				strerror(errno));
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+		ret = drm_atomic_commit(o, qf->fb->fb_id, flags);
+	}
+	if (ret) {
+		printf("failed to commit: %s\n", strerror(errno));
+		return -1;
+	}
+	o->flip_pending = true;
+
+	if (!o->first_commit_time) {
+		o->first_commit_time = qf->times.commit;
+		o->first_commit_modeset = flags & DRM_MODE_ATOMIC_ALLOW_MODESET;
 	}
 
-	return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+	/* Allow a modeset change for the first commit only. */
+	o->flags &= ~(DRM_MODE_ATOMIC_ALLOW_MODESET);
+
+	/* release last buffer to render on again, once this commit's
+	 * out-fence signals, or for async commits once the flip event
+	 * arrives:
+	 */
+	if (sc->has_front && (flags & DRM_MODE_PAGE_FLIP_ASYNC)) {
+		sc->retired = sc->front;
+		sc->has_retired = true;
+	} else if (sc->has_front) {
+		release_frame(o, &sc->front, o->kms_out_fence_fd);
+	} else if (o->kms_out_fence_fd != -1) {
+		close(o->kms_out_fence_fd);
+	}
+	o->kms_out_fence_fd = -1;
+
+	sc->front = *qf;
+	sc->has_front = true;
+	sc->head = (sc->head + 1) % MAX_NUM_BUFFERS;
+	sc->count--;
+
+	return 0;
 }
 
-static int add_plane_property(drmModeAtomicReq *req, uint32_t obj_id,
-				const char *name, uint64_t value)
+/* rendered all the frames it was asked to, or measured enough of them: */
+static bool output_done(const struct output *o)
 {
-	struct plane *obj = drm.plane;
-	unsigned int i;
-	int prop_id = -1;
+	return o->frame >= drm.count || stats_done(o->stats);
+}
+
+/* idle, and waiting for the time to start the next just in time frame: */
+static bool waiting_for_jit(const struct output *o)
+{
+	return jit_enabled(o->jit) && !output_done(o) &&
+		!o->flip_pending && !o->swapchain.count;
+}
+
+/* just in time: one frame at a time, started as late as possible: */
+static bool ready_to_render(const struct output *o)
+{
+	if (output_done(o) || !can_render(o))
+		return false;
+
+	if (jit_enabled(o->jit))
+		return waiting_for_jit(o) && get_time_ns() >= jit_start_time(o->jit);
+
+	return true;
+}
+
+enum event_source {
+	EVENT_DRM,
+	EVENT_STDIN,
+	EVENT_TIMER,
+	EVENT_JIT,
+};
+
+/* file descriptors the atomic loop waits on: */
+static struct {
+	int epfd;
+	int timerfd;       /* periodic statistics report */
+	int jit_timerfd;   /* start of the next just in time frame */
+} loop = {
+	.epfd = -1,
+	.timerfd = -1,
+	.jit_timerfd = -1,
+};
+
+/* Dispatch incoming events, waiting for some if block is set, or only
+ * those that are already there otherwise.  Returns 1 if the user
+ * interrupted, -1 on error.
+ */
+static int handle_events(bool block)
+{
+	drmEventContext evctx = {
+			.version = 2,
+			.page_flip_handler = page_flip_handler,
+	};
+	struct epoll_event events[4];
+	uint64_t expirations;
+	int n;
+
+	do {
+		n = epoll_wait(loop.epfd, events, ARRAY_SIZE(events), block ? -1 : 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		printf("epoll_wait err: %s\n", strerror(errno));
+		return -1;
+	}
 
-	for (i = 0 ; i < obj->props->count_props ; i++) {
-		if (strcmp(obj->props_info[i]->name, name) == 0) {
-			prop_id = obj->props_info[i]->prop_id;
+	for (int e = 0; e < n; e++) {
+		switch (events[e].data.u32) {
+		case EVENT_DRM:
+			drmHandleEvent(drm.fd, &evctx);
+			break;
+		case EVENT_STDIN:
+			printf("user interrupted!\n");
+			return 1;
+		case EVENT_TIMER:
+			if (read(loop.timerfd, &expirations, sizeof(expirations)) > 0) {
+				for (unsigned k = 0; k < num_outputs; k++)
+					stats_report(outputs[k].stats, get_time_ns(), false);
+			}
+			break;
+		case EVENT_JIT:
+			/* nothing to do but wake up: */
+			if (read(loop.jit_timerfd, &expirations, sizeof(expirations)) < 0)
+				return -1;
 			break;
 		}
 	}
 
+	return 0;
+}
+
+static int add_event_source(int fd, enum event_source source)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = source,
+	};
+
+	return epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Wake up for the earliest just in time frame of any idle output.
+ * Returns false if no output is waiting for one:
+ */
+static bool arm_jit_timer(void)
+{
+	int64_t start = INT64_MAX;
+	struct itimerspec its = { 0 };
+
+	for (unsigned k = 0; k < num_outputs; k++) {
+		if (waiting_for_jit(&outputs[k]))
+			start = MIN2(start, jit_start_time(outputs[k].jit));
+	}
+
+	if (start == INT64_MAX)
+		return false;
 
-	if (prop_id < 0) {
-		printf("no plane property: %s\n", name);
-		return -EINVAL;
-	}
+	its.it_value.tv_sec = start / NSEC_PER_SEC;
+	its.it_value.tv_nsec = start % NSEC_PER_SEC;
+	timerfd_settime(loop.jit_timerfd, TFD_TIMER_ABSTIME, &its, NULL);
 
-	return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+	return true;
 }
 
-static int drm_atomic_commit(uint32_t fb_id, uint32_t flags)
+/* Set up the buffers and egl surface of the outputs other than the first,
+ * which use the gbm and egl the cube was initialized with:
+ */
+static int init_output_buffers(struct output *o, const struct gbm *gbm,
+		const struct egl *egl)
 {
-	drmModeAtomicReq *req;
-	uint32_t plane_id = drm.plane->plane->plane_id;
-	uint32_t blob_id;
-	int ret;
+	o->egl = *egl;
 
-	req = drmModeAtomicAlloc();
+	if (o == &outputs[0]) {
+		o->gbm = gbm;
+		return 0;
+	}
 
-	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
-		if (add_connector_property(req, drm.connector_id, "CRTC_ID",
-						drm.crtc_id) < 0)
-				return -1;
+	o->gbm = init_gbm_output(gbm, o->mode.hdisplay, o->mode.vdisplay);
+	if (!o->gbm) {
+		printf("failed to create buffers for output %s\n", o->name);
+		return -1;
+	}
 
-		if (drmModeCreatePropertyBlob(drm.fd, drm.mode, sizeof(*drm.mode),
-					      &blob_id) != 0)
-			return -1;
+	return init_egl_output(&o->egl, o->gbm);
+}
 
-		if (add_crtc_property(req, drm.crtc_id, "MODE_ID", blob_id) < 0)
-			return -1;
+/* all buffers are in use while a flip is pending, with a queued frame
+ * that mailbox can drop to render a newer one:
+ */
+static bool mailbox_full(const struct output *o)
+{
+	return drm.present == PRESENT_MAILBOX && o->flip_pending &&
+		!output_done(o) && !can_render(o) && o->swapchain.count;
+}
 
-		if (add_crtc_property(req, drm.crtc_id, "ACTIVE", 1) < 0)
-			return -1;
-	}
+static void report_output(struct output *o, int64_t cur_time)
+{
+	struct swapchain *sc = &o->swapchain;
 
-	add_plane_property(req, plane_id, "FB_ID", fb_id);
-	add_plane_property(req, plane_id, "CRTC_ID", drm.crtc_id);
-	add_plane_property(req, plane_id, "SRC_X", 0);
-	add_plane_property(req, plane_id, "SRC_Y", 0);
-	add_plane_property(req, plane_id, "SRC_W", drm.mode->hdisplay << 16);
-	add_plane_property(req, plane_id, "SRC_H", drm.mode->vdisplay << 16);
-	add_plane_property(req, plane_id, "CRTC_X", 0);
-	add_plane_property(req, plane_id, "CRTC_Y", 0);
-	add_plane_property(req, plane_id, "CRTC_W", drm.mode->hdisplay);
-	add_plane_property(req, plane_id, "CRTC_H", drm.mode->vdisplay);
+	if (num_outputs > 1)
+		printf("Output %s (%s):\n", o->name, o->mode.name);
 
-	if (drm.kms_in_fence_fd != -1) {
-		add_crtc_property(req, drm.crtc_id, "OUT_FENCE_PTR",
-				VOID2U64(&drm.kms_out_fence_fd));
-		add_plane_property(req, plane_id, "IN_FENCE_FD", drm.kms_in_fence_fd);
-	}
+	stats_report(o->stats, cur_time, true);
 
-	ret = drmModeAtomicCommit(drm.fd, req, flags, NULL);
-	if (ret)
-		goto out;
+	if (sc->in_flight_samples)
+		printf("Frames queued ahead of scanout: avg %.2f, max %u (%u buffers)\n",
+			(double)sc->in_flight_sum / sc->in_flight_samples,
+			sc->in_flight_max, o->gbm->num_buffers);
 
-	if (drm.kms_in_fence_fd != -1) {
-		close(drm.kms_in_fence_fd);
-		drm.kms_in_fence_fd = -1;
-	}
+	printf("Frames rendered: %u, presented: %u, dropped: %u\n",
+		sc->rendered, sc->presented, sc->dropped);
 
-out:
-	drmModeAtomicFree(req);
+	/* mailbox renders unthrottled, so should have rendered more than
+	 * the display could show:
+	 */
+	if (drm.present == PRESENT_MAILBOX && sc->presented > 1 &&
+	    sc->rendered <= sc->presented)
+		printf("warning: mailbox rendered no faster than the flip rate\n");
 
-	return ret;
+	jit_report(o->jit);
+	vblank_report(o->vblank);
 }
 
-static EGLSyncKHR create_fence(const struct egl *egl, int fd)
+static int atomic_run(const struct gbm *gbm, const struct egl *egl)
 {
-	EGLint attrib_list[] = {
-		EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fd,
-		EGL_NONE,
+	int64_t t;
+	struct itimerspec report_interval = {
+		.it_interval = { .tv_sec = 2 },
+		.it_value = { .tv_sec = 2 },
 	};
-	EGLSyncKHR fence = egl->eglCreateSyncKHR(egl->display,
-			EGL_SYNC_NATIVE_FENCE_ANDROID, attrib_list);
-	assert(fence);
-	return fence;
-}
+	int ret = 0;
 
-static int atomic_run(const struct gbm *gbm, const struct egl *egl)
-{
-	struct gbm_bo *bo = NULL;
-	struct drm_fb *fb;
-	uint32_t i = 0;
-	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
-	int64_t start_time, report_time, cur_time;
-	int ret;
+	commit_time_ns = 0;
+	commit_count = 0;
 
 	if (egl_check(egl, eglDupNativeFenceFDANDROID) ||
 	    egl_check(egl, eglCreateSyncKHR) ||
 	    egl_check(egl, eglDestroySyncKHR) ||
-	    egl_check(egl, eglWaitSyncKHR) ||
-	    egl_check(egl, eglClientWaitSyncKHR))
+	    egl_check(egl, eglWaitSyncKHR))
 		return -1;
 
-	/* Allow a modeset change for the first commit only. */
-	flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
-
-	start_time = report_time = get_time_ns();
-
-	while (i < drm.count) {
-		unsigned frame = i;
-		struct gbm_bo *next_bo;
-		EGLSyncKHR gpu_fence = NULL;   /* out-fence from gpu, in-fence to kms */
-		EGLSyncKHR kms_fence = NULL;   /* in-fence to gpu, out-fence from kms */
-
-		if (drm.kms_out_fence_fd != -1) {
-			kms_fence = create_fence(egl, drm.kms_out_fence_fd);
-			assert(kms_fence);
-
-			/* driver now has ownership of the fence fd: */
-			drm.kms_out_fence_fd = -1;
-
-			/* wait "on the gpu" (ie. this won't necessarily block, but
-			 * will block the rendering until fence is signaled), until
-			 * the previous pageflip completes so we don't render into
-			 * the buffer that is still on screen.
-			 */
-			egl->eglWaitSyncKHR(egl->display, kms_fence, 0);
+	for (unsigned k = 0; k < num_outputs; k++) {
+		struct output *o = &outputs[k];
+
+		/* async flips don't wait for vblank, so there are none to miss: */
+		o->stats = stats_new(o->name,
+				drm.present == PRESENT_ASYNC ? 0 : o->mode.vrefresh);
+		o->jit = jit_new(&o->mode, drm.jit_margin_ns >= 0, drm.jit_margin_ns);
+		o->vblank = vblank_new(&o->mode);
+		if (!o->stats || !o->jit || !o->vblank) {
+			printf("failed to allocate stats for %s\n", o->name);
+			for (unsigned n = 0; n <= k; n++) {
+				stats_free(outputs[n].stats);
+				jit_free(outputs[n].jit);
+				vblank_free(outputs[n].vblank);
+			}
+			return -1;
 		}
+		init_swapchain(&o->swapchain);
+		o->frame = 0;
+		o->flip_pending = false;
 
-		/* Start fps measuring on second frame, to remove the time spent
-		 * compiling shader, etc, from the fps:
+		o->first_commit_time = 0;
+
+		/* Allow a modeset change for the first commit only, and only
+		 * if the crtc isn't showing the mode already, to not blank
+		 * the screen for nothing:
 		 */
-		if (i == 1) {
-			start_time = report_time = get_time_ns();
+		o->flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+		if (mode_is_current(drm.fd, o->crtc_id, o->connector_id, &o->mode))
+			printf("Output %s already shows %s, skipping the modeset\n",
+					o->name, o->mode.name);
+		else
+			o->flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+		if (init_output_buffers(o, gbm, egl)) {
+			ret = -1;
+			goto out;
 		}
+	}
 
-		if (!gbm->surface) {
-			glBindFramebuffer(GL_FRAMEBUFFER, egl->fbs[frame % NUM_BUFFERS].fb);
-		}
+	/* A single epoll loop waits for the flip events on the drm fd, user
+	 * input, the periodic statistics report and the just in time render
+	 * deadline, so the CPU is free to prepare the next frame while a
+	 * flip is pending instead of blocking on the previous out-fence:
+	 */
+	loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+	loop.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	loop.jit_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop.epfd < 0 || loop.timerfd < 0 || loop.jit_timerfd < 0) {
+		printf("could not create event loop: %s\n", strerror(errno));
+		ret = -1;
+		goto out;
+	}
 
-		egl->draw(i++);
+	if (add_event_source(drm.fd, EVENT_DRM) ||
+	    add_event_source(loop.timerfd, EVENT_TIMER) ||
+	    add_event_source(loop.jit_timerfd, EVENT_JIT)) {
+		printf("could not set up event loop: %s\n", strerror(errno));
+		ret = -1;
+		goto out;
+	}
 
-		/* insert fence to be singled in cmdstream.. this fence will be
-		 * signaled when gpu rendering done
-		 */
-		gpu_fence = create_fence(egl, EGL_NO_NATIVE_FENCE_FD_ANDROID);
-		assert(gpu_fence);
+	/* stdin may be a regular file or /dev/null, which can't be polled,
+	 * in which case there simply is no way to interrupt:
+	 */
+	if (add_event_source(STDIN_FILENO, EVENT_STDIN) && errno != EPERM) {
+		printf("could not watch stdin: %s\n", strerror(errno));
+		ret = -1;
+		goto out;
+	}
 
-		if (gbm->surface) {
-			eglSwapBuffers(egl->display, egl->surface);
-		}
+	timerfd_settime(loop.timerfd, 0, &report_interval, NULL);
 
-		/* after swapbuffers, gpu_fence should be flushed, so safe
-		 * to get fd:
-		 */
-		drm.kms_in_fence_fd = egl->eglDupNativeFenceFDANDROID(egl->display, gpu_fence);
-		egl->eglDestroySyncKHR(egl->display, gpu_fence);
-		assert(drm.kms_in_fence_fd != -1);
+	while (true) {
+		bool busy = false, ready = false, flip_pending = false;
 
-		if (gbm->surface) {
-			next_bo = gbm_surface_lock_front_buffer(gbm->surface);
-		} else {
-			next_bo = gbm->bos[frame % NUM_BUFFERS];
-		}
-		if (!next_bo) {
-			printf("Failed to lock frontbuffer\n");
-			return -1;
-		}
-		fb = drm_fb_get_from_bo(next_bo);
-		if (!fb) {
-			printf("Failed to get a new framebuffer BO\n");
-			return -1;
-		}
+		for (unsigned k = 0; k < num_outputs; k++) {
+			struct output *o = &outputs[k];
+			struct swapchain *sc = &o->swapchain;
 
-		if (kms_fence) {
-			EGLint status;
+			/* Mailbox never waits for the flip to render: when all
+			 * buffers are in use, the oldest frame that is not on
+			 * screen yet is thrown away to make room for a newer one:
+			 */
+			if (mailbox_full(o))
+				drop_frame(o);
+
+			if (ready_to_render(o)) {
+				struct queued_frame *qf = &sc->queue[
+						(sc->head + sc->count) % MAX_NUM_BUFFERS];
+				unsigned in_flight = sc->count + o->flip_pending;
+
+				sc->in_flight_sum += in_flight;
+				sc->in_flight_max = MAX2(sc->in_flight_max, in_flight);
+				sc->in_flight_samples++;
+
+				ret = render_frame(o, qf);
+				if (ret)
+					goto out;
+				sc->count++;
+				sc->rendered++;
+			}
 
-			/* Wait on the CPU side for the _previous_ commit to
-			 * complete before we post the flip through KMS, as
-			 * atomic will reject the commit if we post a new one
-			 * whilst the previous one is still pending.
+			/* Atomic will reject the commit if we post a new one whilst
+			 * the previous one is still pending, so queued frames go out
+			 * one per flip event:
 			 */
-			do {
-				status = egl->eglClientWaitSyncKHR(egl->display,
-								   kms_fence,
-								   0,
-								   EGL_FOREVER_KHR);
-			} while (status != EGL_CONDITION_SATISFIED_KHR);
-
-			egl->eglDestroySyncKHR(egl->display, kms_fence);
-		}
+			if (!o->flip_pending && sc->count) {
+				ret = commit_frame(o);
+				if (ret)
+					goto out;
+			}
 
-		cur_time = get_time_ns();
-		if (cur_time > (report_time + 2 * NSEC_PER_SEC)) {
-			double elapsed_time = cur_time - start_time;
-			double secs = elapsed_time / (double)NSEC_PER_SEC;
-			unsigned frames = i - 1;  /* first frame ignored */
-			printf("Rendered %u frames in %f sec (%f fps)\n",
-				frames, secs, (double)frames/secs);
-			report_time = cur_time;
+			/* something queued or on its way to the screen: */
+			busy |= o->flip_pending || !output_done(o);
+			/* with mailbox, a full queue makes room on the next pass
+			 * rather than waiting for the flip:
+			 */
+			ready |= ready_to_render(o) || mailbox_full(o);
+			flip_pending |= o->flip_pending;
 		}
 
-		/* Check for user input: */
-		struct pollfd fdset[] = { {
-			.fd = STDIN_FILENO,
-			.events = POLLIN,
-		} };
-		ret = poll(fdset, ARRAY_SIZE(fdset), 0);
-		if (ret > 0) {
-			printf("user interrupted!\n");
-			return 0;
-		}
+		if (!busy)
+			break;
 
-		/*
-		 * Here you could also update drm plane layers if you want
-		 * hw composition
+		/* Keep rendering ahead as long as there is a free buffer,
+		 * otherwise sleep until a flip completes (or until it is
+		 * time to start the next just in time frame):
 		 */
-		ret = drm_atomic_commit(fb->fb_id, flags);
-		if (ret) {
-			printf("failed to commit: %s\n", strerror(errno));
-			return -1;
+		if (ready) {
+			ret = handle_events(false);
+		} else if (arm_jit_timer() || !flip_pending) {
+			t = trace_begin();
+			ret = handle_events(true);
+			trace_end("wait for render deadline", t);
+		} else {
+			t = trace_begin();
+			ret = handle_events(true);
+			trace_end("wait for flip", t);
+		}
+		if (ret < 0)
+			goto out;
+		if (ret > 0) {
+			ret = 0;
+			break;
 		}
+	}
 
-		/* release last buffer to render on again: */
-		if (bo && gbm->surface)
-			gbm_surface_release_buffer(gbm->surface, bo);
-		bo = next_bo;
+	/* let the last flips land before tearing anything down: */
+	for (unsigned k = 0; k < num_outputs; k++) {
+		while (outputs[k].flip_pending && handle_events(true) == 0)
+			;
+	}
 
-		/* Allow a modeset change for the first commit only. */
-		flags &= ~(DRM_MODE_ATOMIC_ALLOW_MODESET);
+	/* frames that never made it to the screen: */
+	for (unsigned k = 0; k < num_outputs; k++) {
+		while (outputs[k].swapchain.count)
+			drop_frame(&outputs[k]);
 	}
 
 	finish_perfcntrs();
 
-	cur_time = get_time_ns();
-	double elapsed_time = cur_time - start_time;
-	double secs = elapsed_time / (double)NSEC_PER_SEC;
-	unsigned frames = i - 1;  /* first frame ignored */
-	printf("Rendered %u frames in %f sec (%f fps)\n",
-		frames, secs, (double)frames/secs);
+	int64_t cur_time = get_time_ns();
+	for (unsigned k = 0; k < num_outputs; k++)
+		report_output(&outputs[k], cur_time);
+
+	if (commit_count)
+		printf("Atomic commit CPU time: %.1f us/frame\n",
+			(double)commit_time_ns / commit_count / (NSEC_PER_SEC / USEC_PER_SEC));
+
+	dump_perfcntrs(stats_frames(outputs[0].stats),
+			stats_elapsed(outputs[0].stats, cur_time));
 
-	dump_perfcntrs(frames, elapsed_time);
+out:
+	for (unsigned k = 0; k < num_outputs; k++) {
+		stats_free(outputs[k].stats);
+		jit_free(outputs[k].jit);
+		vblank_free(outputs[k].vblank);
+		fini_swapchain(&outputs[k].swapchain);
+	}
+	close(loop.jit_timerfd);
+	close(loop.timerfd);
+	close(loop.epfd);
 
 	return ret;
 }
 
+static bool plane_taken(uint32_t plane_id)
+{
+	for (unsigned k = 0; k < num_outputs; k++) {
+		if (outputs[k].plane.plane->plane_id == plane_id)
+			return true;
+	}
+
+	for (unsigned n = 0; n < num_layers; n++) {
+		if (layers[n]->plane.plane->plane_id == plane_id)
+			return true;
+	}
+
+	return false;
+}
+
 /* Pick a plane.. something that at a minimum can be connected to
- * the chosen crtc, but prefer primary plane.
+ * the chosen crtc, but prefer primary plane.  Planes already picked
+ * for other outputs are skipped.
  *
  * Seems like there is some room for a drmModeObjectGetNamedProperty()
  * type helper in libdrm..
  */
-static int get_plane_id(void)
+static uint64_t get_plane_type(uint32_t plane_id)
+{
+	drmModeObjectPropertiesPtr props =
+		drmModeObjectGetProperties(drm.fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+
+	if (!props)
+		return type;
+
+	for (uint32_t j = 0; j < props->count_props; j++) {
+		drmModePropertyPtr p = drmModeGetProperty(drm.fd, props->props[j]);
+
+		if (strcmp(p->name, "type") == 0)
+			type = props->prop_values[j];
+
+		drmModeFreeProperty(p);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return type;
+}
+
+static bool cached_plane_usable(uint32_t plane_id, int crtc_index)
+{
+	drmModePlanePtr plane;
+	bool usable;
+
+	if (plane_taken(plane_id))
+		return false;
+
+	plane = drmModeGetPlane(drm.fd, plane_id);
+	if (!plane)
+		return false;
+	usable = plane->possible_crtcs & (1 << crtc_index);
+	drmModeFreePlane(plane);
+
+	return usable && get_plane_type(plane_id) == DRM_PLANE_TYPE_PRIMARY;
+}
+
+static int get_plane_id(int crtc_index)
 {
 	drmModePlaneResPtr plane_resources;
 	uint32_t i, j;
@@ -354,13 +1445,17 @@ static int get_plane_id(void)
 
 	for (i = 0; (i < plane_resources->count_planes) && !found_primary; i++) {
 		uint32_t id = plane_resources->planes[i];
+
+		if (plane_taken(id))
+			continue;
+
 		drmModePlanePtr plane = drmModeGetPlane(drm.fd, id);
 		if (!plane) {
 			printf("drmModeGetPlane(%u) failed: %s\n", id, strerror(errno));
 			continue;
 		}
 
-		if (plane->possible_crtcs & (1 << drm.crtc_index)) {
+		if (plane->possible_crtcs & (1 << crtc_index)) {
 			drmModeObjectPropertiesPtr props =
 				drmModeObjectGetProperties(drm.fd, id, DRM_MODE_OBJECT_PLANE);
 
@@ -391,73 +1486,379 @@ static int get_plane_id(void)
 	return ret;
 }
 
-const struct drm * init_drm_atomic(const char *device, const char *mode_str,
-		unsigned int vrefresh, unsigned int count)
+/* Modifiers the plane can scan out format with, from its IN_FORMATS
+ * property.  Returns how many were found, none if the property (which is
+ * optional) is missing:
+ */
+static unsigned get_plane_modifiers(const struct plane *plane, uint32_t format,
+		uint64_t *mods, unsigned max_mods)
 {
-	uint32_t plane_id;
-	int ret;
+	const struct drm_format_modifier_blob *header;
+	const struct drm_format_modifier *fmt_mods;
+	const uint32_t *formats;
+	drmModePropertyBlobPtr blob = NULL;
+	unsigned n = 0;
+
+	for (uint32_t i = 0; i < plane->props->count_props && !blob; i++) {
+		if (strcmp(plane->props_info[i]->name, "IN_FORMATS") == 0)
+			blob = drmModeGetPropertyBlob(drm.fd, plane->props->prop_values[i]);
+	}
+	if (!blob)
+		return 0;
 
-	ret = init_drm(&drm, device, mode_str, vrefresh, count);
-	if (ret)
-		return NULL;
+	header = blob->data;
+	formats = (const uint32_t *)((const char *)header + header->formats_offset);
+	fmt_mods = (const struct drm_format_modifier *)
+			((const char *)header + header->modifiers_offset);
 
-	ret = drmSetClientCap(drm.fd, DRM_CLIENT_CAP_ATOMIC, 1);
-	if (ret) {
-		printf("no atomic modesetting support: %s\n", strerror(errno));
-		return NULL;
+	/* each modifier has a bitmask of the (up to 64) formats it applies
+	 * to, starting from its offset into the format list:
+	 */
+	for (uint32_t f = 0; f < header->count_formats; f++) {
+		if (formats[f] != format)
+			continue;
+
+		for (uint32_t m = 0; m < header->count_modifiers && n < max_mods; m++) {
+			if (f < fmt_mods[m].offset || f >= fmt_mods[m].offset + 64)
+				continue;
+			if (fmt_mods[m].formats & (1ULL << (f - fmt_mods[m].offset)))
+				mods[n++] = fmt_mods[m].modifier;
+		}
 	}
 
-	ret = get_plane_id();
-	if (!ret) {
-		printf("could not find a suitable plane\n");
-		return NULL;
-	} else {
-		plane_id = ret;
+	drmModeFreePropertyBlob(blob);
+
+	return n;
+}
+
+/* The modifiers for format that the planes of all outputs support: */
+static unsigned get_common_modifiers(uint32_t format)
+{
+	unsigned n = get_plane_modifiers(&outputs[0].plane, format,
+			modifiers, MAX_MODIFIERS);
+
+	for (unsigned k = 1; k < num_outputs; k++) {
+		uint64_t other[MAX_MODIFIERS];
+		unsigned num_other = get_plane_modifiers(&outputs[k].plane, format,
+				other, MAX_MODIFIERS);
+		unsigned kept = 0;
+
+		for (unsigned i = 0; i < n; i++) {
+			for (unsigned j = 0; j < num_other; j++) {
+				if (modifiers[i] == other[j]) {
+					modifiers[kept++] = modifiers[i];
+					break;
+				}
+			}
+		}
+		n = kept;
 	}
 
-	/* We only do single plane to single crtc to single connector, no
-	 * fancy multi-monitor or multi-plane stuff.  So just grab the
-	 * plane/crtc/connector property info for one of each:
+	return n;
+}
+
+static unsigned atomic_get_modifiers(uint32_t format, const uint64_t **mods)
+{
+	*mods = modifiers;
+	return get_common_modifiers(format);
+}
+
+/* Look up the plane, crtc and connector of an output, and their
+ * properties, and prepare its commits:
+ */
+static int init_output(const struct output_config *config)
+{
+	struct output *o = &outputs[num_outputs];
+	uint32_t plane_id;
+	int ret;
+
+	memset(o, 0, sizeof(*o));
+	o->connector_id = config->connector_id;
+	o->crtc_id = config->crtc_id;
+	o->crtc_index = config->crtc_index;
+	o->mode = config->mode;
+	o->kms_in_fence_fd = -1;
+	o->kms_out_fence_fd = -1;
+
+	/* the plane the last run used only needs checking, rather than
+	 * looking at the properties of every plane:
 	 */
-	drm.plane = calloc(1, sizeof(*drm.plane));
-	drm.crtc = calloc(1, sizeof(*drm.crtc));
-	drm.connector = calloc(1, sizeof(*drm.connector));
+	ret = probe_cache_plane();
+	if (num_outputs || !ret || !cached_plane_usable(ret, o->crtc_index))
+		ret = get_plane_id(o->crtc_index);
+	if (ret <= 0) {
+		printf("could not find a suitable plane for connector %u\n",
+				o->connector_id);
+		return -1;
+	} else {
+		plane_id = ret;
+	}
 
 #define get_resource(type, Type, id) do { 					\
-		drm.type->type = drmModeGet##Type(drm.fd, id);			\
-		if (!drm.type->type) {						\
+		o->type.type = drmModeGet##Type(drm.fd, id);			\
+		if (!o->type.type) {						\
 			printf("could not get %s %i: %s\n",			\
 					#type, id, strerror(errno));		\
-			return NULL;						\
+			return -1;						\
 		}								\
 	} while (0)
 
 	get_resource(plane, Plane, plane_id);
-	get_resource(crtc, Crtc, drm.crtc_id);
-	get_resource(connector, Connector, drm.connector_id);
+	get_resource(crtc, Crtc, o->crtc_id);
+	/* init_drm() already probed it, no need to do that again: */
+	get_resource(connector, ConnectorCurrent, o->connector_id);
 
 #define get_properties(type, TYPE, id) do {					\
 		uint32_t i;							\
-		drm.type->props = drmModeObjectGetProperties(drm.fd,		\
+		o->type.props = drmModeObjectGetProperties(drm.fd,		\
 				id, DRM_MODE_OBJECT_##TYPE);			\
-		if (!drm.type->props) {						\
+		if (!o->type.props) {						\
 			printf("could not get %s %u properties: %s\n", 		\
 					#type, id, strerror(errno));		\
-			return NULL;						\
+			return -1;						\
 		}								\
-		drm.type->props_info = calloc(drm.type->props->count_props,	\
-				sizeof(*drm.type->props_info));			\
-		for (i = 0; i < drm.type->props->count_props; i++) {		\
-			drm.type->props_info[i] = drmModeGetProperty(drm.fd,	\
-					drm.type->props->props[i]);		\
+		o->type.props_info = calloc(o->type.props->count_props,		\
+				sizeof(*o->type.props_info));			\
+		for (i = 0; i < o->type.props->count_props; i++) {		\
+			o->type.props_info[i] = drmModeGetProperty(drm.fd,	\
+					o->type.props->props[i]);		\
 		}								\
 	} while (0)
 
 	get_properties(plane, PLANE, plane_id);
-	get_properties(crtc, CRTC, drm.crtc_id);
-	get_properties(connector, CONNECTOR, drm.connector_id);
+	get_properties(crtc, CRTC, o->crtc_id);
+	get_properties(connector, CONNECTOR, o->connector_id);
+
+	if (init_property_ids(o)) {
+		printf("missing atomic properties\n");
+		return -1;
+	}
+
+	if (init_commit_template(o)) {
+		printf("could not build atomic commit template\n");
+		return -1;
+	}
+
+	snprintf(o->name, sizeof(o->name), "atomic-%u", o->connector_id);
+	num_outputs++;
+
+	return 0;
+}
+
+/* Pick a free plane for a layer on the given crtc, that can scan out
+ * the format.  Prefer overlays, and never take the cursor plane:
+ */
+static uint32_t get_layer_plane_id(int crtc_index, uint32_t format)
+{
+	drmModePlaneResPtr plane_resources;
+	uint32_t ret = 0;
+	bool found_overlay = false;
+
+	plane_resources = drmModeGetPlaneResources(drm.fd);
+	if (!plane_resources) {
+		printf("drmModeGetPlaneResources failed: %s\n", strerror(errno));
+		return 0;
+	}
+
+	for (uint32_t i = 0; (i < plane_resources->count_planes) && !found_overlay; i++) {
+		uint32_t id = plane_resources->planes[i];
+		bool has_format = false;
+		uint64_t type;
+
+		if (plane_taken(id))
+			continue;
+
+		drmModePlanePtr plane = drmModeGetPlane(drm.fd, id);
+		if (!plane)
+			continue;
+
+		for (uint32_t j = 0; j < plane->count_formats; j++)
+			has_format |= plane->formats[j] == format;
+
+		if (has_format && (plane->possible_crtcs & (1 << crtc_index))) {
+			type = get_plane_type(id);
+			if (type != DRM_PLANE_TYPE_CURSOR) {
+				ret = id;
+				found_overlay = type == DRM_PLANE_TYPE_OVERLAY;
+			}
+		}
+
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(plane_resources);
+
+	return ret;
+}
+
+/* Show bo on a plane of its own, on the first output.  Returns NULL if
+ * there is no plane to spare (or no atomic modesetting), in which case
+ * the caller draws the content itself, same as when the layer ends up
+ * not passing the test commit.  Bos are handed to config->release once
+ * they are no longer needed.
+ */
+struct layer * layer_new(struct gbm_bo *bo, const struct layer_config *config)
+{
+	struct layer *l;
+	uint32_t plane_id;
+
+	if (!num_outputs || num_layers == MAX_LAYERS)
+		return NULL;
+
+	plane_id = get_layer_plane_id(outputs[0].crtc_index, gbm_bo_get_format(bo));
+	if (!plane_id) {
+		printf("no free plane for a layer, drawing it on the gpu\n");
+		return NULL;
+	}
+
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return NULL;
+
+	l->plane.plane = drmModeGetPlane(drm.fd, plane_id);
+	l->plane.props = drmModeObjectGetProperties(drm.fd, plane_id,
+			DRM_MODE_OBJECT_PLANE);
+	if (!l->plane.plane || !l->plane.props) {
+		printf("could not get plane %u: %s\n", plane_id, strerror(errno));
+		drmModeFreePlane(l->plane.plane);
+		free(l);
+		return NULL;
+	}
+	l->plane.props_info = calloc(l->plane.props->count_props,
+			sizeof(*l->plane.props_info));
+	for (uint32_t i = 0; i < l->plane.props->count_props; i++) {
+		l->plane.props_info[i] = drmModeGetProperty(drm.fd,
+				l->plane.props->props[i]);
+	}
+
+	if (init_plane_property_ids(&l->plane, &l->props)) {
+		free_layer(l);
+		return NULL;
+	}
+
+	l->config = *config;
+	layer_set_bo(l, bo);
+
+	layers[num_layers++] = l;
+
+	return l;
+}
+
+/* Show a new buffer on the layer, from the next frame on: */
+void layer_set_bo(struct layer *l, struct gbm_bo *bo)
+{
+	struct drm_fb *fb = drm_fb_get_from_bo(bo);
+	uint32_t format = gbm_bo_get_format(bo);
+	uint32_t w = gbm_bo_get_width(bo), h = gbm_bo_get_height(bo);
+
+	/* flipping to another buffer of the same kind needs no new test: */
+	if (!fb || !l->fb_id || format != l->format || w != l->src_w || h != l->src_h)
+		l->tested = false;
+
+	/* replaced before it was ever committed: */
+	if (l->bo != bo && l->bo != l->queued_bo && l->bo != l->front_bo)
+		release_layer_bo(l, l->bo);
+
+	l->bo = bo;
+	l->fb_id = fb ? fb->fb_id : 0;
+	l->format = format;
+	l->src_w = w;
+	l->src_h = h;
+	l->dirty = true;
+}
+
+void layer_move(struct layer *l, int32_t x, int32_t y)
+{
+	l->config.x = x;
+	l->config.y = y;
+	l->tested = false;
+	l->dirty = true;
+}
+
+/* Whether the layer is shown by its plane (as of the next commit), or
+ * needs to be drawn by the gpu as part of the frame:
+ */
+bool layer_on_plane(const struct layer *l)
+{
+	return l && (l->tested ? l->on_plane : l->enabled);
+}
+
+/* Take the layer off its plane with the next commit: */
+void layer_free(struct layer *l)
+{
+	if (!l)
+		return;
+
+	if (l->bo != l->queued_bo && l->bo != l->front_bo)
+		release_layer_bo(l, l->bo);
+	l->bo = NULL;
+
+	l->removed = true;
+	l->tested = false;
+	l->dirty = true;
+}
+
+const struct drm * init_drm_atomic(const char *device, const char *mode_str,
+		unsigned int vrefresh, unsigned int count, enum present_mode present,
+		int64_t jit_margin_ns, bool all_outputs)
+{
+	struct output_config configs[MAX_OUTPUTS];
+	unsigned num_configs = 1;
+	int ret;
+
+	ret = init_drm(&drm, device, mode_str, vrefresh, count);
+	if (ret)
+		return NULL;
+
+	ret = drmSetClientCap(drm.fd, DRM_CLIENT_CAP_ATOMIC, 1);
+	if (ret) {
+		printf("no atomic modesetting support: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	/* The connector init_drm() picked comes first, and is the one the
+	 * cube's gbm and egl are set up for.  With all_outputs, every other
+	 * connected connector that has a crtc to spare gets its own plane,
+	 * buffers and flip loop, all rendered by the same context:
+	 */
+	configs[0] = (struct output_config){
+		.connector_id = drm.connector_id,
+		.crtc_id = drm.crtc_id,
+		.crtc_index = drm.crtc_index,
+		.mode = *drm.mode,
+	};
+	if (all_outputs)
+		num_configs += find_extra_outputs(&drm, mode_str, vrefresh,
+				&configs[1], MAX_OUTPUTS - 1);
 
+	for (unsigned k = 0; k < num_configs; k++) {
+		if (init_output(&configs[k]))
+			return NULL;
+	}
+
+	/* with a single output, keep the name older versions reported: */
+	if (num_outputs == 1)
+		strcpy(outputs[0].name, "atomic");
+	else
+		printf("Driving %u outputs\n", num_outputs);
+
+	if (present == PRESENT_ASYNC) {
+		uint64_t cap = 0;
+
+		ret = drmGetCap(drm.fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap);
+		if (ret || !cap) {
+			printf("no atomic async page flip support, falling back to vsync\n");
+			present = PRESENT_FIFO;
+		}
+	}
+
+	drm.present = present;
+	drm.jit_margin_ns = jit_margin_ns;
+	drm.get_modifiers = atomic_get_modifiers;
 	drm.run = atomic_run;
 
+	probe_cache_save(&drm, outputs[0].plane.plane->plane_id);
+	startup_phase("planes");
+
 	return &drm;
 }
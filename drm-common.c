@@ -24,10 +24,13 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <linux/sync_file.h>
+#include <sys/ioctl.h>
 
 #include "common.h"
 #include "drm-common.h"
@@ -44,6 +47,9 @@ gbm_bo_get_stride_for_plane(struct gbm_bo *bo, int plane);
 WEAK uint32_t
 gbm_bo_get_offset(struct gbm_bo *bo, int plane);
 
+WEAK union gbm_bo_handle
+gbm_bo_get_handle_for_plane(struct gbm_bo *bo, int plane);
+
 static void
 drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
 {
@@ -76,19 +82,24 @@ struct drm_fb * drm_fb_get_from_bo(struct gbm_bo *bo)
 	format = gbm_bo_get_format(bo);
 
 	if (gbm_bo_get_modifier && gbm_bo_get_plane_count &&
-	    gbm_bo_get_stride_for_plane && gbm_bo_get_offset) {
+	    gbm_bo_get_stride_for_plane && gbm_bo_get_offset &&
+	    gbm_bo_get_handle_for_plane) {
 
 		uint64_t modifiers[4] = {0};
 		modifiers[0] = gbm_bo_get_modifier(bo);
 		const int num_planes = gbm_bo_get_plane_count(bo);
 		for (int i = 0; i < num_planes; i++) {
 			strides[i] = gbm_bo_get_stride_for_plane(bo, i);
-			handles[i] = gbm_bo_get_handle(bo).u32;
+			/* imported planes may each be in their own dmabuf: */
+			handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
 			offsets[i] = gbm_bo_get_offset(bo, i);
 			modifiers[i] = modifiers[0];
 		}
 
-		if (modifiers[0]) {
+		/* imported buffers can have an implicit (driver internal)
+		 * layout, which is passed on the same way:
+		 */
+		if (modifiers[0] && modifiers[0] != DRM_FORMAT_MOD_INVALID) {
 			flags = DRM_MODE_FB_MODIFIERS;
 			printf("Using modifier %" PRIx64 "\n", modifiers[0]);
 		}
@@ -120,6 +131,88 @@ struct drm_fb * drm_fb_get_from_bo(struct gbm_bo *bo)
 	return fb;
 }
 
+/* The nominal vrefresh is rounded, use the exact pixel timings: */
+int64_t mode_refresh_ns(const drmModeModeInfo *mode)
+{
+	if (mode->clock && mode->htotal && mode->vtotal)
+		return (int64_t)mode->htotal * mode->vtotal *
+				(NSEC_PER_SEC / MSEC_PER_SEC) / mode->clock;
+	else if (mode->vrefresh)
+		return NSEC_PER_SEC / mode->vrefresh;
+
+	return 0;
+}
+
+static bool same_timings(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+	return a->clock == b->clock &&
+		a->hdisplay == b->hdisplay && a->hsync_start == b->hsync_start &&
+		a->hsync_end == b->hsync_end && a->htotal == b->htotal &&
+		a->hskew == b->hskew &&
+		a->vdisplay == b->vdisplay && a->vsync_start == b->vsync_start &&
+		a->vsync_end == b->vsync_end && a->vtotal == b->vtotal &&
+		a->vscan == b->vscan && a->flags == b->flags;
+}
+
+/* Whether the crtc already drives the connector in this mode (ie. as
+ * left by fbcon or a boot splash), in which case showing a frame only
+ * takes a flip, rather than a modeset that blanks the screen:
+ */
+bool mode_is_current(int fd, uint32_t crtc_id, uint32_t connector_id,
+		const drmModeModeInfo *mode)
+{
+	drmModeConnector *connector;
+	drmModeEncoder *encoder = NULL;
+	drmModeCrtc *crtc;
+	bool current;
+
+	crtc = drmModeGetCrtc(fd, crtc_id);
+	if (!crtc)
+		return false;
+
+	connector = drmModeGetConnectorCurrent(fd, connector_id);
+	if (connector && connector->encoder_id)
+		encoder = drmModeGetEncoder(fd, connector->encoder_id);
+
+	current = crtc->mode_valid && encoder && encoder->crtc_id == crtc_id &&
+		same_timings(&crtc->mode, mode);
+
+	drmModeFreeEncoder(encoder);
+	drmModeFreeConnector(connector);
+	drmModeFreeCrtc(crtc);
+
+	return current;
+}
+
+/* Time (CLOCK_MONOTONIC) at which a sync_file signaled, or 0 if it has
+ * not signaled (yet):
+ */
+int64_t sync_file_signal_time(int fd)
+{
+	struct sync_file_info info = { .num_fences = 0 };
+	struct sync_fence_info *fences;
+	int64_t time = 0;
+
+	if (ioctl(fd, SYNC_IOC_FILE_INFO, &info) || info.status != 1 ||
+	    !info.num_fences)
+		return 0;
+
+	fences = calloc(info.num_fences, sizeof(*fences));
+	if (!fences)
+		return 0;
+
+	info.sync_fence_info = VOID2U64(fences);
+	if (ioctl(fd, SYNC_IOC_FILE_INFO, &info) == 0) {
+		/* the sync_file signals when the last of its fences does: */
+		for (unsigned i = 0; i < info.num_fences; i++)
+			time = MAX2(time, (int64_t)fences[i].timestamp_ns);
+	}
+
+	free(fences);
+
+	return time;
+}
+
 static uint32_t find_crtc_for_encoder(const drmModeRes *resources,
 		const drmModeEncoder *encoder) {
 	int i;
@@ -169,6 +262,114 @@ static int get_resources(int fd, drmModeRes **resources)
 	return 0;
 }
 
+/* The device, connector and (with atomic) primary plane the last run
+ * picked, see init_probe_cache():
+ */
+static struct {
+	bool enabled;
+	bool hit;              /* the cached ones are still good */
+	char device[PATH_MAX]; /* of the device in use, cached or not */
+	uint32_t connector_id;
+	uint32_t plane_id;
+} probe;
+
+static bool probe_cache_path(char *path, size_t size)
+{
+	const char *dir = get_cache_dir();
+
+	if (!dir)
+		return false;
+	snprintf(path, size, "%s/probe", dir);
+	return true;
+}
+
+/* Remember the device, connector and plane picked, and try them first
+ * next time.  Finding them takes opening every device, and probing every
+ * connector for a display (which can mean reading its EDID), while the
+ * cached connector is revalidated with drmModeGetConnectorCurrent(),
+ * which only returns what the kernel already knows.  Anything that no
+ * longer checks out falls back to the full search.
+ */
+void init_probe_cache(void)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	probe.enabled = true;
+
+	if (!probe_cache_path(path, sizeof(path)))
+		return;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (fscanf(f, "%4095s %" SCNu32 " %" SCNu32, probe.device,
+			&probe.connector_id, &probe.plane_id) != 3)
+		probe.connector_id = 0;
+	fclose(f);
+}
+
+static drmModeConnector * probe_cache_lookup(struct drm *drm,
+		const char *device, drmModeRes **resources)
+{
+	drmModeConnector *connector;
+
+	if (!probe.connector_id || (device && strcmp(device, probe.device)))
+		return NULL;
+
+	drm->fd = open(probe.device, O_RDWR);
+	if (drm->fd < 0)
+		goto miss;
+
+	if (get_resources(drm->fd, resources) == 0) {
+		connector = drmModeGetConnectorCurrent(drm->fd, probe.connector_id);
+		if (connector && connector->connection == DRM_MODE_CONNECTED &&
+		    connector->count_modes > 0) {
+			printf("Using %s connector %u from the probe cache\n",
+					probe.device, probe.connector_id);
+			probe.hit = true;
+			return connector;
+		}
+		drmModeFreeConnector(connector);
+		drmModeFreeResources(*resources);
+	}
+	close(drm->fd);
+
+miss:
+	drm->fd = -1;
+	probe.connector_id = 0;
+	probe.plane_id = 0;
+	return NULL;
+}
+
+/* the primary plane of the cached selection, if it still checked out: */
+uint32_t probe_cache_plane(void)
+{
+	return probe.hit ? probe.plane_id : 0;
+}
+
+void probe_cache_save(const struct drm *drm, uint32_t plane_id)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	if (!probe.enabled || !probe.device[0])
+		return;
+	if (probe.hit && probe.connector_id == drm->connector_id &&
+	    probe.plane_id == plane_id)
+		return;
+
+	if (!probe_cache_path(path, sizeof(path)))
+		return;
+
+	f = fopen(path, "w");
+	if (!f)
+		return;
+	fprintf(f, "%s %" PRIu32 " %" PRIu32 "\n", probe.device,
+			drm->connector_id, plane_id);
+	fclose(f);
+}
+
 #define MAX_DRM_DEVICES 64
 
 static int find_drm_device(drmModeRes **resources)
@@ -196,8 +397,11 @@ static int find_drm_device(drmModeRes **resources)
 		if (fd < 0)
 			continue;
 		ret = get_resources(fd, resources);
-		if (!ret)
+		if (!ret) {
+			snprintf(probe.device, sizeof(probe.device), "%s",
+					device->nodes[DRM_NODE_PRIMARY]);
 			break;
+		}
 		close(fd);
 		fd = -1;
 	}
@@ -208,15 +412,63 @@ static int find_drm_device(drmModeRes **resources)
 	return fd;
 }
 
+static drmModeModeInfo * choose_mode(drmModeConnector *connector,
+		const char *mode_str, unsigned int vrefresh)
+{
+	drmModeModeInfo *mode = NULL;
+	int i, area;
+
+	/* find user requested mode: */
+	if (mode_str && *mode_str) {
+		for (i = 0; i < connector->count_modes; i++) {
+			drmModeModeInfo *current_mode = &connector->modes[i];
+
+			if (strcmp(current_mode->name, mode_str) == 0) {
+				if (vrefresh == 0 || current_mode->vrefresh == vrefresh) {
+					mode = current_mode;
+					break;
+				}
+			}
+		}
+		if (!mode)
+			printf("requested mode not found, using default mode!\n");
+	}
+
+	/* find preferred mode or the highest resolution mode: */
+	if (!mode) {
+		for (i = 0, area = 0; i < connector->count_modes; i++) {
+			drmModeModeInfo *current_mode = &connector->modes[i];
+
+			if (current_mode->type & DRM_MODE_TYPE_PREFERRED) {
+				mode = current_mode;
+				break;
+			}
+
+			int current_area = current_mode->hdisplay * current_mode->vdisplay;
+			if (current_area > area) {
+				mode = current_mode;
+				area = current_area;
+			}
+		}
+	}
+
+	return mode;
+}
+
 int init_drm(struct drm *drm, const char *device, const char *mode_str,
 		unsigned int vrefresh, unsigned int count)
 {
 	drmModeRes *resources;
 	drmModeConnector *connector = NULL;
 	drmModeEncoder *encoder = NULL;
-	int i, ret, area;
+	int i, ret;
+
+	connector = probe_cache_lookup(drm, device, &resources);
+	if (connector)
+		goto found_connector;
 
 	if (device) {
+		snprintf(probe.device, sizeof(probe.device), "%s", device);
 		drm->fd = open(device, O_RDWR);
 		ret = get_resources(drm->fd, &resources);
 		if (ret < 0 && errno == EOPNOTSUPP)
@@ -235,6 +487,8 @@ int init_drm(struct drm *drm, const char *device, const char *mode_str,
 		return -1;
 	}
 
+	startup_phase("open device");
+
 	/* find a connected connector: */
 	for (i = 0; i < resources->count_connectors; i++) {
 		connector = drmModeGetConnector(drm->fd, resources->connectors[i]);
@@ -254,40 +508,10 @@ int init_drm(struct drm *drm, const char *device, const char *mode_str,
 		return -1;
 	}
 
-	/* find user requested mode: */
-	if (mode_str && *mode_str) {
-		for (i = 0; i < connector->count_modes; i++) {
-			drmModeModeInfo *current_mode = &connector->modes[i];
-
-			if (strcmp(current_mode->name, mode_str) == 0) {
-				if (vrefresh == 0 || current_mode->vrefresh == vrefresh) {
-					drm->mode = current_mode;
-					break;
-				}
-			}
-		}
-		if (!drm->mode)
-			printf("requested mode not found, using default mode!\n");
-	}
-
-	/* find preferred mode or the highest resolution mode: */
-	if (!drm->mode) {
-		for (i = 0, area = 0; i < connector->count_modes; i++) {
-			drmModeModeInfo *current_mode = &connector->modes[i];
-
-			if (current_mode->type & DRM_MODE_TYPE_PREFERRED) {
-				drm->mode = current_mode;
-				break;
-			}
-
-			int current_area = current_mode->hdisplay * current_mode->vdisplay;
-			if (current_area > area) {
-				drm->mode = current_mode;
-				area = current_area;
-			}
-		}
-	}
+found_connector:
+	startup_phase("connector");
 
+	drm->mode = choose_mode(connector, mode_str, vrefresh);
 	if (!drm->mode) {
 		printf("could not find mode!\n");
 		return -1;
@@ -326,5 +550,86 @@ int init_drm(struct drm *drm, const char *device, const char *mode_str,
 	drm->connector_id = connector->connector_id;
 	drm->count = count;
 
+	startup_phase("crtc");
+
 	return 0;
 }
+
+/* index of a crtc the connector can be driven by, and that is not in
+ * used_crtcs (a mask of crtc indices):
+ */
+static int find_free_crtc(int fd, const drmModeRes *resources,
+		const drmModeConnector *connector, uint32_t used_crtcs)
+{
+	for (int i = 0; i < connector->count_encoders; i++) {
+		drmModeEncoder *encoder = drmModeGetEncoder(fd, connector->encoders[i]);
+		uint32_t possible_crtcs;
+
+		if (!encoder)
+			continue;
+
+		possible_crtcs = encoder->possible_crtcs & ~used_crtcs;
+		drmModeFreeEncoder(encoder);
+
+		for (int j = 0; j < resources->count_crtcs; j++) {
+			if (possible_crtcs & (1 << j))
+				return j;
+		}
+	}
+
+	return -1;
+}
+
+/* Find the connected connectors other than the one init_drm() picked,
+ * each with a crtc of its own, so they can all be driven at once.
+ * Returns the number found.
+ */
+unsigned find_extra_outputs(const struct drm *drm, const char *mode_str,
+		unsigned int vrefresh, struct output_config *outputs,
+		unsigned max_outputs)
+{
+	drmModeRes *resources;
+	uint32_t used_crtcs = 1 << drm->crtc_index;
+	unsigned n = 0;
+
+	if (get_resources(drm->fd, &resources))
+		return 0;
+
+	for (int i = 0; i < resources->count_connectors && n < max_outputs; i++) {
+		drmModeConnector *connector;
+		drmModeModeInfo *mode;
+		int crtc_index;
+
+		if (resources->connectors[i] == drm->connector_id)
+			continue;
+
+		connector = drmModeGetConnector(drm->fd, resources->connectors[i]);
+		if (!connector)
+			continue;
+
+		if (connector->connection != DRM_MODE_CONNECTED) {
+			drmModeFreeConnector(connector);
+			continue;
+		}
+
+		mode = choose_mode(connector, mode_str, vrefresh);
+		crtc_index = find_free_crtc(drm->fd, resources, connector, used_crtcs);
+		if (mode && crtc_index >= 0) {
+			used_crtcs |= 1 << crtc_index;
+			outputs[n].connector_id = connector->connector_id;
+			outputs[n].crtc_id = resources->crtcs[crtc_index];
+			outputs[n].crtc_index = crtc_index;
+			outputs[n].mode = *mode;
+			n++;
+		} else {
+			printf("can't drive connector %u, no %s\n", connector->connector_id,
+					mode ? "free crtc" : "mode");
+		}
+
+		drmModeFreeConnector(connector);
+	}
+
+	drmModeFreeResources(resources);
+
+	return n;
+}
@@ -30,6 +30,8 @@
 struct gbm;
 struct egl;
 
+#define VOID2U64(x) ((uint64_t)(unsigned long)(x))
+
 struct plane {
 	drmModePlane *plane;
 	drmModeObjectProperties *props;
@@ -48,24 +50,38 @@ struct connector {
 	drmModePropertyRes **props_info;
 };
 
+enum present_mode {
+	PRESENT_FIFO,       /* every frame is shown, one per vblank */
+	PRESENT_MAILBOX,    /* only the newest finished frame is shown */
+	PRESENT_ASYNC,      /* flip immediately, without waiting for vblank */
+};
+
 struct drm {
 	int fd;
 
-	/* only used for atomic: */
-	struct plane *plane;
-	struct crtc *crtc;
-	struct connector *connector;
 	int crtc_index;
-	int kms_in_fence_fd;
-	int kms_out_fence_fd;
-
 	drmModeModeInfo *mode;
 	uint32_t crtc_id;
 	uint32_t connector_id;
 
+	/* no crtc, nothing ever scans the buffers out: */
+	bool offscreen;
+
 	/* number of frames to run for: */
 	unsigned int count;
 
+	enum present_mode present;
+
+	/* start rendering this long before the predicted vblank, or < 0 to
+	 * render as soon as possible:
+	 */
+	int64_t jit_margin_ns;
+
+	/* get the modifiers the plane(s) can scan out in format, from
+	 * IN_FORMATS (atomic only, returns 0 if the driver doesn't say):
+	 */
+	unsigned (*get_modifiers)(uint32_t format, const uint64_t **modifiers);
+
 	int (*run)(const struct gbm *gbm, const struct egl *egl);
 };
 
@@ -76,8 +92,90 @@ struct drm_fb {
 
 struct drm_fb * drm_fb_get_from_bo(struct gbm_bo *bo);
 
+int64_t mode_refresh_ns(const drmModeModeInfo *mode);
+bool mode_is_current(int fd, uint32_t crtc_id, uint32_t connector_id,
+		const drmModeModeInfo *mode);
+int64_t sync_file_signal_time(int fd);
+
+/* when each phase of producing a frame finished (CLOCK_MONOTONIC): */
+struct frame_times {
+	unsigned frame;
+	int64_t render_start;
+	int64_t draw_done;      /* cpu done submitting it */
+	int64_t gpu_done;       /* gpu done rendering it, 0 if unknown */
+	int64_t commit;         /* flip (or commit) queued */
+};
+
+enum frame_phase {
+	PHASE_DRAW,
+	PHASE_GPU,
+	PHASE_COMMIT,
+};
+
+struct vblank;
+
+struct vblank * vblank_new(const drmModeModeInfo *mode);
+void vblank_free(struct vblank *v);
+unsigned vblank_flip(struct vblank *v, unsigned sequence, int64_t time_ns,
+		const struct frame_times *ft);
+void vblank_report(const struct vblank *v);
+
+struct jit;
+
+struct jit * jit_new(const drmModeModeInfo *mode, bool enabled, int64_t margin_ns);
+void jit_free(struct jit *j);
+bool jit_enabled(const struct jit *j);
+int64_t jit_start_time(const struct jit *j);
+void jit_frame_done(struct jit *j, int64_t render_start, int64_t gpu_done, int64_t scanout);
+void jit_vblank(struct jit *j, int64_t vblank_time);
+void jit_report(const struct jit *j);
+
+/* Hardware plane layers (atomic only, first output): buffers shown on
+ * planes of their own and composited by the display, instead of being
+ * drawn by the gpu every frame.  Each configuration change is checked
+ * with a test-only commit before it goes out with the next frame, and
+ * layers the hardware can't show are left to the gpu: check
+ * layer_on_plane() before each frame to know whether to draw the
+ * layer's content as part of it.
+ */
+struct layer_config {
+	int32_t x, y;           /* position on the crtc */
+	uint32_t w, h;          /* size on the crtc, 0 for the size of the bo */
+	int zpos;               /* stacking order, the cube's plane is 0 */
+	uint16_t alpha;         /* plane alpha, 0xffff is opaque */
+
+	/* called once a bo is off screen (or was replaced before it made
+	 * it there), so it can be reused or destroyed:
+	 */
+	void (*release)(struct gbm_bo *bo);
+};
+
+struct layer;
+
+struct layer * layer_new(struct gbm_bo *bo, const struct layer_config *config);
+void layer_set_bo(struct layer *l, struct gbm_bo *bo);
+void layer_move(struct layer *l, int32_t x, int32_t y);
+bool layer_on_plane(const struct layer *l);
+void layer_free(struct layer *l);
+
+/* a connector, with the crtc and mode to drive it with: */
+struct output_config {
+	uint32_t connector_id;
+	uint32_t crtc_id;
+	int crtc_index;
+	drmModeModeInfo mode;
+};
+
+void init_probe_cache(void);
+uint32_t probe_cache_plane(void);
+void probe_cache_save(const struct drm *drm, uint32_t plane_id);
 int init_drm(struct drm *drm, const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count);
-const struct drm * init_drm_legacy(const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count);
-const struct drm * init_drm_atomic(const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count);
+unsigned find_extra_outputs(const struct drm *drm, const char *mode_str, unsigned int vrefresh,
+		struct output_config *outputs, unsigned max_outputs);
+const struct drm * init_drm_legacy(const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count,
+		enum present_mode present, int64_t jit_margin_ns);
+const struct drm * init_drm_atomic(const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count,
+		enum present_mode present, int64_t jit_margin_ns, bool all_outputs);
+const struct drm * init_drm_offscreen(const char *device, const char *mode_str, unsigned int vrefresh, unsigned int count);
 
 #endif /* _DRM_COMMON_H */
@@ -25,20 +25,29 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "drm-common.h"
 
 static struct drm drm;
 
+/* when the last flip happened, according to the kernel: */
+static int64_t flip_timestamp;
+static unsigned flip_sequence;
+
 static void page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
 {
 	/* suppress 'unused parameter' warnings */
-	(void)fd, (void)frame, (void)sec, (void)usec;
+	(void)fd;
 
 	int *waiting_for_flip = data;
 	*waiting_for_flip = 0;
+
+	flip_timestamp = sec * NSEC_PER_SEC + usec * (NSEC_PER_SEC / USEC_PER_SEC);
+	flip_sequence = frame;
 }
 
 static int legacy_run(const struct gbm *gbm, const struct egl *egl)
@@ -51,8 +60,26 @@ static int legacy_run(const struct gbm *gbm, const struct egl *egl)
 	struct gbm_bo *bo;
 	struct drm_fb *fb;
 	uint32_t i = 0;
-	int64_t start_time, report_time, cur_time;
-	int ret;
+	/* async flips don't wait for vblank, so there are none to miss: */
+	struct stats *stats = stats_new("legacy",
+			drm.present == PRESENT_ASYNC ? 0 : drm.mode->vrefresh);
+	uint32_t flip_flags = DRM_MODE_PAGE_FLIP_EVENT;
+	struct jit *jit = jit_new(drm.mode, drm.jit_margin_ns >= 0, drm.jit_margin_ns);
+	struct vblank *vblank = vblank_new(drm.mode);
+	/* to find out when the gpu is done with a frame, without waiting: */
+	bool native_fences = egl->eglCreateSyncKHR && egl->eglDestroySyncKHR &&
+			egl->eglDupNativeFenceFDANDROID;
+	int64_t report_time, cur_time, flip_time, t;
+	int gpu_fence_fd = -1;
+	int ret = -1;
+
+	if (!stats || !jit || !vblank) {
+		printf("failed to allocate stats\n");
+		goto out;
+	}
+
+	if (drm.present == PRESENT_ASYNC)
+		flip_flags |= DRM_MODE_PAGE_FLIP_ASYNC;
 
 	if (gbm->surface) {
 		eglSwapBuffers(egl->display, egl->surface);
@@ -63,48 +90,111 @@ static int legacy_run(const struct gbm *gbm, const struct egl *egl)
 	fb = drm_fb_get_from_bo(bo);
 	if (!fb) {
 		fprintf(stderr, "Failed to get a new framebuffer BO\n");
-		return -1;
+		goto out;
 	}
 
-	/* set mode: */
-	ret = drmModeSetCrtc(drm.fd, drm.crtc_id, fb->fb_id, 0, 0,
-			&drm.connector_id, 1, drm.mode);
+	/* set mode, unless the crtc shows it already, in which case a flip
+	 * is enough and doesn't blank the screen.  Drivers may refuse to
+	 * flip to a framebuffer of a different format than the one on
+	 * screen though, so fall back to the modeset:
+	 */
+	t = get_time_ns();
+	ret = -1;
+	if (mode_is_current(drm.fd, drm.crtc_id, drm.connector_id, drm.mode)) {
+		int waiting_for_flip = 1;
+
+		ret = drmModePageFlip(drm.fd, drm.crtc_id, fb->fb_id,
+				DRM_MODE_PAGE_FLIP_EVENT, &waiting_for_flip);
+		while (!ret && waiting_for_flip)
+			ret = drmHandleEvent(drm.fd, &evctx);
+		if (ret)
+			printf("flip without modeset failed (%s), doing a modeset\n",
+					strerror(errno));
+	}
 	if (ret) {
-		printf("failed to set mode: %s\n", strerror(errno));
-		return ret;
+		ret = drmModeSetCrtc(drm.fd, drm.crtc_id, fb->fb_id, 0, 0,
+				&drm.connector_id, 1, drm.mode);
+		if (ret) {
+			printf("failed to set mode: %s\n", strerror(errno));
+			goto out;
+		}
+		printf("First frame (modeset) took %.1f ms to show up\n",
+			(double)(get_time_ns() - t) / (NSEC_PER_SEC / MSEC_PER_SEC));
+	} else {
+		printf("First frame (no modeset) took %.1f ms to show up\n",
+			(double)(get_time_ns() - t) / (NSEC_PER_SEC / MSEC_PER_SEC));
 	}
 
-	start_time = report_time = get_time_ns();
+	report_time = get_time_ns();
 
-	while (i < drm.count) {
+	while (i < drm.count && !stats_done(stats)) {
 		unsigned frame = i;
 		struct gbm_bo *next_bo;
 		int waiting_for_flip = 1;
+		struct frame_times times = { .frame = frame };
 
-		/* Start fps measuring on second frame, to remove the time spent
-		 * compiling shader, etc, from the fps:
-		 */
-		if (i == 1) {
-			start_time = report_time = get_time_ns();
+		if (jit_enabled(jit) && jit_start_time(jit) > get_time_ns()) {
+			int64_t start = jit_start_time(jit);
+			struct timespec ts = {
+				.tv_sec = start / NSEC_PER_SEC,
+				.tv_nsec = start % NSEC_PER_SEC,
+			};
+
+			t = trace_begin();
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			trace_end("wait for render deadline", t);
 		}
 
 		if (!gbm->surface) {
-			glBindFramebuffer(GL_FRAMEBUFFER, egl->fbs[frame % NUM_BUFFERS].fb);
+			glBindFramebuffer(GL_FRAMEBUFFER, egl->fbs[frame % gbm->num_buffers].fb);
 		}
 
+		times.render_start = get_time_ns();
+		t = trace_begin();
 		egl->draw(i++);
+		trace_end("draw", t);
 
 		if (gbm->surface) {
+			EGLSyncKHR gpu_fence = NULL;
+
+			if (native_fences) {
+				static const EGLint attrib_list[] = {
+					EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+					EGL_NONE,
+				};
+				gpu_fence = egl->eglCreateSyncKHR(egl->display,
+						EGL_SYNC_NATIVE_FENCE_ANDROID, attrib_list);
+			} else if (jit_enabled(jit)) {
+				/* the render cost estimate needs to know when the gpu
+				 * is done, and without fences the only way is to wait:
+				 */
+				glFinish();
+				times.gpu_done = get_time_ns();
+			}
+			t = trace_begin();
 			eglSwapBuffers(egl->display, egl->surface);
+			trace_end("eglSwapBuffers", t);
+			times.draw_done = get_time_ns();
+			if (gpu_fence) {
+				gpu_fence_fd = egl->eglDupNativeFenceFDANDROID(egl->display, gpu_fence);
+				egl->eglDestroySyncKHR(egl->display, gpu_fence);
+			}
+			t = trace_begin();
 			next_bo = gbm_surface_lock_front_buffer(gbm->surface);
+			trace_end("gbm_surface_lock_front_buffer", t);
 		} else {
+			times.draw_done = get_time_ns();
 			glFinish();
-			next_bo = gbm->bos[frame % NUM_BUFFERS];
+			times.gpu_done = get_time_ns();
+			next_bo = gbm->bos[frame % gbm->num_buffers];
 		}
+		t = trace_begin();
 		fb = drm_fb_get_from_bo(next_bo);
+		trace_end("drm_fb_get_from_bo", t);
 		if (!fb) {
 			fprintf(stderr, "Failed to get a new framebuffer BO\n");
-			return -1;
+			ret = -1;
+			goto out;
 		}
 
 		/*
@@ -112,11 +202,22 @@ static int legacy_run(const struct gbm *gbm, const struct egl *egl)
 		 * hw composition
 		 */
 
+		times.commit = get_time_ns();
+		flip_time = t = trace_begin();
 		ret = drmModePageFlip(drm.fd, drm.crtc_id, fb->fb_id,
-				DRM_MODE_PAGE_FLIP_EVENT, &waiting_for_flip);
+				flip_flags, &waiting_for_flip);
+		if (ret && (flip_flags & DRM_MODE_PAGE_FLIP_ASYNC)) {
+			/* some drivers only do async flips in some configurations: */
+			printf("async page flip failed (%s), falling back to vsync\n",
+					strerror(errno));
+			flip_flags &= ~DRM_MODE_PAGE_FLIP_ASYNC;
+			ret = drmModePageFlip(drm.fd, drm.crtc_id, fb->fb_id,
+					flip_flags, &waiting_for_flip);
+		}
+		trace_end("drmModePageFlip", t);
 		if (ret) {
 			printf("failed to queue page flip: %s\n", strerror(errno));
-			return -1;
+			goto out;
 		}
 
 		while (waiting_for_flip) {
@@ -127,24 +228,44 @@ static int legacy_run(const struct gbm *gbm, const struct egl *egl)
 			ret = select(drm.fd + 1, &fds, NULL, NULL, NULL);
 			if (ret < 0) {
 				printf("select err: %s\n", strerror(errno));
-				return ret;
+				goto out;
 			} else if (ret == 0) {
 				printf("select timeout!\n");
-				return -1;
+				ret = -1;
+				goto out;
 			} else if (FD_ISSET(0, &fds)) {
 				printf("user interrupted!\n");
-				return 0;
+				ret = 0;
+				goto out;
 			}
 			drmHandleEvent(drm.fd, &evctx);
 		}
+		trace_end("page flip", flip_time);
+
+		if (gpu_fence_fd != -1) {
+			times.gpu_done = sync_file_signal_time(gpu_fence_fd);
+			close(gpu_fence_fd);
+			gpu_fence_fd = -1;
+		}
+
+		jit_frame_done(jit, times.render_start, times.gpu_done, flip_timestamp);
+		jit_vblank(jit, flip_timestamp);
+
+		/* async flips don't wait for a vblank, so they can't miss one: */
+		if (flip_flags & DRM_MODE_PAGE_FLIP_ASYNC)
+			stats_missed(stats, 0);
+		else
+			stats_missed(stats, vblank_flip(vblank, flip_sequence,
+					flip_timestamp, &times));
 
 		cur_time = get_time_ns();
+		stats_frame(stats, cur_time);
+		if (frame == 0) {
+			startup_phase("first frame");
+			startup_report();
+		}
 		if (cur_time > (report_time + 2 * NSEC_PER_SEC)) {
-			double elapsed_time = cur_time - start_time;
-			double secs = elapsed_time / (double)NSEC_PER_SEC;
-			unsigned frames = i - 1;  /* first frame ignored */
-			printf("Rendered %u frames in %f sec (%f fps)\n",
-				frames, secs, (double)frames/secs);
+			stats_report(stats, cur_time, false);
 			report_time = cur_time;
 		}
 
@@ -158,27 +279,48 @@ static int legacy_run(const struct gbm *gbm, const struct egl *egl)
 	finish_perfcntrs();
 
 	cur_time = get_time_ns();
-	double elapsed_time = cur_time - start_time;
-	double secs = elapsed_time / (double)NSEC_PER_SEC;
-	unsigned frames = i - 1;  /* first frame ignored */
-	printf("Rendered %u frames in %f sec (%f fps)\n",
-		frames, secs, (double)frames/secs);
+	stats_report(stats, cur_time, true);
+	jit_report(jit);
+	vblank_report(vblank);
 
-	dump_perfcntrs(frames, elapsed_time);
+	dump_perfcntrs(stats_frames(stats), stats_elapsed(stats, cur_time));
+	ret = 0;
 
-	return 0;
+out:
+	if (gpu_fence_fd != -1)
+		close(gpu_fence_fd);
+	stats_free(stats);
+	jit_free(jit);
+	vblank_free(vblank);
+
+	return ret;
 }
 
 const struct drm * init_drm_legacy(const char *device, const char *mode_str,
-		unsigned int vrefresh, unsigned int count)
+		unsigned int vrefresh, unsigned int count, enum present_mode present,
+		int64_t jit_margin_ns)
 {
+	uint64_t cap = 0;
 	int ret;
 
 	ret = init_drm(&drm, device, mode_str, vrefresh, count);
 	if (ret)
 		return NULL;
 
+	if (present == PRESENT_ASYNC) {
+		ret = drmGetCap(drm.fd, DRM_CAP_ASYNC_PAGE_FLIP, &cap);
+		if (ret || !cap) {
+			printf("no async page flip support, falling back to vsync\n");
+			present = PRESENT_FIFO;
+		}
+	}
+
+	drm.present = present;
+	drm.jit_margin_ns = jit_margin_ns;
+
 	drm.run = legacy_run;
 
+	probe_cache_save(&drm, 0);
+
 	return &drm;
 }
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2020 The kmscube authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Headless backend: render into a ring of offscreen buffers on a render
+ * node, without any KMS device, connector or page flips.  Frames are
+ * produced as fast as the GPU can go, which makes this useful to measure
+ * renderer throughput on machines without a display.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "drm-common.h"
+
+/* mode used when none is given with --vmode=WxH: */
+#define DEFAULT_WIDTH  1920
+#define DEFAULT_HEIGHT 1080
+
+static struct drm drm;
+static drmModeModeInfo offscreen_mode;
+
+static int offscreen_run(const struct gbm *gbm, const struct egl *egl)
+{
+	EGLSyncKHR fences[MAX_NUM_BUFFERS] = { NULL };
+	bool use_fences = egl->eglCreateSyncKHR && egl->eglDestroySyncKHR &&
+			egl->eglClientWaitSyncKHR;
+	uint32_t i = 0;
+	struct stats *stats = stats_new("offscreen", drm.mode->vrefresh);
+	int64_t report_time, cur_time, t;
+	int ret;
+
+	if (!stats) {
+		printf("failed to allocate stats\n");
+		return -1;
+	}
+
+	report_time = get_time_ns();
+
+	while (i < drm.count && !stats_done(stats)) {
+		unsigned frame = i;
+		unsigned slot = frame % gbm->num_buffers;
+
+		if (!gbm->surface) {
+			/* Nothing scans the buffers out, so the only thing that
+			 * limits how far ahead we can queue is the GPU still
+			 * rendering the last frame that used this buffer:
+			 */
+			if (fences[slot]) {
+				t = trace_begin();
+				egl->eglClientWaitSyncKHR(egl->display, fences[slot],
+						0, EGL_FOREVER_KHR);
+				trace_end("eglClientWaitSyncKHR", t);
+				egl->eglDestroySyncKHR(egl->display, fences[slot]);
+				fences[slot] = NULL;
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, egl->fbs[slot].fb);
+		}
+
+		t = trace_begin();
+		egl->draw(i++);
+		trace_end("draw", t);
+
+		if (gbm->surface) {
+			struct gbm_bo *bo;
+
+			t = trace_begin();
+			eglSwapBuffers(egl->display, egl->surface);
+			trace_end("eglSwapBuffers", t);
+			bo = gbm_surface_lock_front_buffer(gbm->surface);
+			if (!bo) {
+				printf("Failed to lock frontbuffer\n");
+				return -1;
+			}
+			/* nobody is going to look at it, hand it straight back: */
+			gbm_surface_release_buffer(gbm->surface, bo);
+		} else if (use_fences) {
+			fences[slot] = egl->eglCreateSyncKHR(egl->display,
+					EGL_SYNC_FENCE_KHR, NULL);
+			glFlush();
+		} else {
+			glFinish();
+		}
+
+		cur_time = get_time_ns();
+		stats_frame(stats, cur_time);
+		if (frame == 0) {
+			startup_phase("first frame");
+			startup_report();
+		}
+		if (cur_time > (report_time + 2 * NSEC_PER_SEC)) {
+			stats_report(stats, cur_time, false);
+			report_time = cur_time;
+		}
+
+		/* Check for user input: */
+		struct pollfd fdset[] = { {
+			.fd = STDIN_FILENO,
+			.events = POLLIN,
+		} };
+		ret = poll(fdset, ARRAY_SIZE(fdset), 0);
+		if (ret > 0) {
+			printf("user interrupted!\n");
+			break;
+		}
+	}
+
+	/* make sure everything queued is accounted for in the elapsed time: */
+	glFinish();
+
+	for (unsigned n = 0; n < ARRAY_SIZE(fences); n++) {
+		if (fences[n])
+			egl->eglDestroySyncKHR(egl->display, fences[n]);
+	}
+
+	finish_perfcntrs();
+
+	cur_time = get_time_ns();
+	stats_report(stats, cur_time, true);
+
+	dump_perfcntrs(stats_frames(stats), stats_elapsed(stats, cur_time));
+	stats_free(stats);
+
+	return 0;
+}
+
+#define MAX_DRM_DEVICES 64
+
+static int find_render_node(void)
+{
+	drmDevicePtr devices[MAX_DRM_DEVICES] = { NULL };
+	int num_devices, fd = -1;
+
+	num_devices = drmGetDevices2(0, devices, MAX_DRM_DEVICES);
+	if (num_devices < 0) {
+		printf("drmGetDevices2 failed: %s\n", strerror(-num_devices));
+		return -1;
+	}
+
+	for (int i = 0; i < num_devices; i++) {
+		drmDevicePtr device = devices[i];
+
+		if (!(device->available_nodes & (1 << DRM_NODE_RENDER)))
+			continue;
+
+		fd = open(device->nodes[DRM_NODE_RENDER], O_RDWR);
+		if (fd >= 0) {
+			printf("Using render node %s\n",
+					device->nodes[DRM_NODE_RENDER]);
+			break;
+		}
+	}
+	drmFreeDevices(devices, num_devices);
+
+	if (fd < 0)
+		printf("no render node found!\n");
+	return fd;
+}
+
+const struct drm * init_drm_offscreen(const char *device, const char *mode_str,
+		unsigned int vrefresh, unsigned int count)
+{
+	unsigned int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT;
+
+	if (device) {
+		drm.fd = open(device, O_RDWR);
+		if (drm.fd < 0)
+			printf("could not open %s: %s\n", device, strerror(errno));
+	} else {
+		drm.fd = find_render_node();
+	}
+
+	if (drm.fd < 0) {
+		printf("could not open drm device\n");
+		return NULL;
+	}
+
+	/* There is no connector to pick a mode from, so the mode string
+	 * is interpreted as the size of the offscreen buffers:
+	 */
+	if (mode_str && *mode_str) {
+		if (sscanf(mode_str, "%ux%u", &width, &height) != 2 ||
+				!width || !height) {
+			printf("invalid offscreen size '%s', expected WxH\n", mode_str);
+			close(drm.fd);
+			return NULL;
+		}
+	}
+
+	offscreen_mode.hdisplay = width;
+	offscreen_mode.vdisplay = height;
+	offscreen_mode.vrefresh = vrefresh;
+	snprintf(offscreen_mode.name, sizeof(offscreen_mode.name),
+			"%ux%u", width, height);
+
+	drm.mode = &offscreen_mode;
+	drm.offscreen = true;
+	drm.count = count;
+	drm.run = offscreen_run;
+
+	printf("Rendering offscreen at %s, no page flips\n", offscreen_mode.name);
+	startup_phase("open device");
+
+	return &drm;
+}
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "common.h"
@@ -45,12 +46,50 @@ GST_DEBUG_CATEGORY_EXTERN(kmscube_debug);
 
 #define MAX_NUM_PLANES 3
 
+/* frames handed out by video_frame_bo() that are not released yet: */
+#define MAX_SCANOUT_FRAMES 8
+
+/* imported frames kept around for reuse, see lookup_image(): */
+#define MAX_CACHED_IMAGES 16
+
+/* buffers to upload frames in system memory to, see upload_frame(): */
+#define NUM_UPLOAD_BOS 3
+
+/* frames queued in the appsink, see video_init(): */
+#define APPSINK_MAX_BUFFERS 2
+
+/* frames the sink side holds on to at once: the ones queued in the
+ * appsink, the one being rendered and the one still on screen:
+ */
+#define SINK_HELD_FRAMES (APPSINK_MAX_BUFFERS + 2)
+
 inline static const char *
 yesno(int yes)
 {
 	return yes ? "yes" : "no";
 }
 
+struct plane {
+	int fd, offset, stride;
+};
+
+struct cached_image {
+	struct {
+		dev_t dev;      /* identity of the dmabuf */
+		ino_t ino;
+		int offset, stride;
+	} planes[MAX_NUM_PLANES];
+	EGLImage image;
+	unsigned last_used;     /* frame it was last returned for */
+};
+
+struct upload_bo {
+	struct gbm_bo *bo;
+	uint32_t size;
+	EGLImage image;
+	EGLSyncKHR fence;       /* signals when the GPU is done with the frame */
+};
+
 struct decoder {
 	GMainLoop          *loop;
 	GstElement         *pipeline;
@@ -58,6 +97,7 @@ struct decoder {
 	pthread_t           gst_thread;
 
 	uint32_t            format;
+	uint64_t            modifier;       /* from dma-drm caps, or invalid */
 	GstVideoInfo        info;
 
 	const struct gbm   *gbm;
@@ -65,15 +105,56 @@ struct decoder {
 	unsigned            frame;
 
 	EGLImage            last_frame;
+	bool                last_frame_cached;
 	GstSample          *last_samp;
+
+	struct cached_image images[MAX_CACHED_IMAGES];
+	bool                caps_changed;   /* set on the streaming thread */
+	bool                hw_decoder;     /* decodebin picked one */
+
+	struct upload_bo    uploads[NUM_UPLOAD_BOS];
+	struct upload_bo   *last_upload;    /* holding the current frame */
+	unsigned            next_upload;
+	bool                use_fences;
+
+	/* cost of getting an EGLImage for a frame, [0] for frames that had
+	 * to be imported and [1] for frames that reused an image:
+	 */
+	int64_t             import_ns[2];
+	unsigned            imports[2];
 };
 
+/* Frames scanned out directly, each holding on to its sample so the
+ * decoder doesn't reuse the buffer while it is on screen.  Not part of
+ * struct decoder, as they can outlive it when the next file starts:
+ */
+static struct {
+	struct gbm_bo *bo;
+	GstSample *samp;
+} scanout_frames[MAX_SCANOUT_FRAMES];
+
+static uint32_t
+drm_format(GstVideoFormat format)
+{
+	switch (format) {
+	case GST_VIDEO_FORMAT_I420:
+		return DRM_FORMAT_YUV420;
+	case GST_VIDEO_FORMAT_NV12:
+		return DRM_FORMAT_NV12;
+	case GST_VIDEO_FORMAT_YUY2:
+		return DRM_FORMAT_YUYV;
+	default:
+		return 0;
+	}
+}
+
 static GstPadProbeReturn
 pad_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 {
 	struct decoder *dec = user_data;
 	GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
 	GstCaps *caps;
+	uint32_t format;
 
 	(void)pad;
 
@@ -87,25 +168,45 @@ pad_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 		return GST_PAD_PROBE_OK;
 	}
 
+#if GST_CHECK_VERSION(1, 24, 0)
+	if (gst_video_is_dma_drm_caps(caps)) {
+		GstVideoInfoDmaDrm drm_info;
+
+		if (!gst_video_info_dma_drm_from_caps(&drm_info, caps)) {
+			GST_ERROR("caps event with invalid dma-drm caps");
+			return GST_PAD_PROBE_OK;
+		}
+
+		/* Only the size is meaningful here, the layout of tiled or
+		 * compressed frames comes with each buffer's video meta:
+		 */
+		dec->info = drm_info.vinfo;
+		dec->format = drm_info.drm_fourcc;
+		dec->modifier = drm_info.drm_modifier;
+
+		__atomic_store_n(&dec->caps_changed, true, __ATOMIC_RELEASE);
+
+		return GST_PAD_PROBE_OK;
+	}
+#endif
+
 	if (!gst_video_info_from_caps(&dec->info, caps)) {
 		GST_ERROR("caps event with invalid video caps");
 		return GST_PAD_PROBE_OK;
 	}
 
-	switch (GST_VIDEO_INFO_FORMAT(&(dec->info))) {
-	case GST_VIDEO_FORMAT_I420:
-		dec->format = DRM_FORMAT_YUV420;
-		break;
-	case GST_VIDEO_FORMAT_NV12:
-		dec->format = DRM_FORMAT_NV12;
-		break;
-	case GST_VIDEO_FORMAT_YUY2:
-		dec->format = DRM_FORMAT_YUYV;
-		break;
-	default:
+	format = drm_format(GST_VIDEO_INFO_FORMAT(&(dec->info)));
+	if (!format) {
 		GST_ERROR("unknown format\n");
 		return GST_PAD_PROBE_OK;
 	}
+	dec->format = format;
+	dec->modifier = DRM_FORMAT_MOD_INVALID;
+
+	/* the cached images have the old size and format baked in, but they
+	 * can only be dropped on the thread that renders:
+	 */
+	__atomic_store_n(&dec->caps_changed, true, __ATOMIC_RELEASE);
 
 	return GST_PAD_PROBE_OK;
 }
@@ -114,6 +215,7 @@ static void *
 gst_thread_func(void *args)
 {
 	struct decoder *dec = args;
+	init_trace_thread();
 	g_main_loop_run(dec->loop);
 	return NULL;
 }
@@ -121,10 +223,10 @@ gst_thread_func(void *args)
 static void
 element_added_cb(GstBin *bin, GstElement *element, gpointer user_data)
 {
+	struct decoder *dec = user_data;
 	GstElementFactory *elem_factory;
-	gchar const *factory_name;
+	gchar const *factory_name, *klass;
 
-	(void)user_data;
 	(void)bin;
 
 	elem_factory = gst_element_get_factory(element);
@@ -132,6 +234,11 @@ element_added_cb(GstBin *bin, GstElement *element, gpointer user_data)
 
 	GST_DEBUG("added element %s (created with factory %s)", GST_OBJECT_NAME(element), factory_name);
 
+	/* see appsink_query_cb(): */
+	klass = gst_element_factory_get_metadata(elem_factory, GST_ELEMENT_METADATA_KLASS);
+	if (klass && strstr(klass, "Decoder") && strstr(klass, "Hardware"))
+		__atomic_store_n(&dec->hw_decoder, true, __ATOMIC_RELAXED);
+
 	/* v4l2 video decoder factories are generated by the GStreamer v4l probe.
 	 * The format is v4l2videoNdec, where N is an integer. So, check if the
 	 * element's factory name fits this pattern. */
@@ -238,25 +345,252 @@ bus_watch_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
 	return TRUE;
 }
 
+/* A buffer pool of linear dmabufs allocated with gbm.  It is offered to
+ * hardware decoders in the allocation query, so that the ones which would
+ * otherwise produce system memory write straight into buffers we can
+ * import, rather than having every frame copied by upload_frame().
+ */
+typedef struct {
+	GstBufferPool       parent;
+	const struct gbm   *gbm;
+	GstAllocator       *allocator;
+	GstVideoInfo        info;
+} GbmPool;
+
+typedef struct {
+	GstBufferPoolClass  parent_class;
+} GbmPoolClass;
+
+GType gbm_pool_get_type(void);
+G_DEFINE_TYPE(GbmPool, gbm_pool, GST_TYPE_BUFFER_POOL)
+
+static const gchar **
+gbm_pool_get_options(GstBufferPool *pool G_GNUC_UNUSED)
+{
+	static const gchar *options[] = { GST_BUFFER_POOL_OPTION_VIDEO_META, NULL };
+	return options;
+}
+
+static gboolean
+gbm_pool_set_config(GstBufferPool *pool, GstStructure *config)
+{
+	GbmPool *self = (GbmPool *)pool;
+	GstCaps *caps;
+	guint size, min, max;
+
+	if (!gst_buffer_pool_config_get_params(config, &caps, &size, &min, &max) ||
+	    !caps || !gst_video_info_from_caps(&self->info, caps))
+		return FALSE;
+
+	if (!drm_format(GST_VIDEO_INFO_FORMAT(&self->info)))
+		return FALSE;
+
+	return GST_BUFFER_POOL_CLASS(gbm_pool_parent_class)->set_config(pool, config);
+}
+
+static GstFlowReturn
+gbm_pool_alloc_buffer(GstBufferPool *pool, GstBuffer **buffer,
+		GstBufferPoolAcquireParams *params G_GNUC_UNUSED)
+{
+	GbmPool *self = (GbmPool *)pool;
+	GstVideoInfo *info = &self->info;
+	guint stride = GST_VIDEO_INFO_PLANE_STRIDE(info, 0);
+	struct gbm_bo *bo;
+	GstBuffer *buf;
+	int fd;
+
+	/* The planes are laid out as in the video info, and the video meta
+	 * tells the importer where they are, so the bo only has to be big
+	 * enough.  NOTE: do not actually use GBM_BO_USE_WRITE since that
+	 * gets us a dumb buffer:
+	 */
+	bo = gbm_bo_create(self->gbm->dev, stride,
+			(info->size + stride - 1) / stride,
+			GBM_FORMAT_R8, GBM_BO_USE_LINEAR);
+	if (!bo) {
+		GST_ERROR("could not allocate pool buffer");
+		return GST_FLOW_ERROR;
+	}
+
+	/* the dmabuf keeps the buffer alive: */
+	fd = gbm_bo_get_fd(bo);
+	gbm_bo_destroy(bo);
+	if (fd < 0) {
+		GST_ERROR("could not export pool buffer");
+		return GST_FLOW_ERROR;
+	}
+
+	buf = gst_buffer_new();
+	gst_buffer_append_memory(buf,
+			gst_dmabuf_allocator_alloc(self->allocator, fd, info->size));
+	gst_buffer_add_video_meta_full(buf, GST_VIDEO_FRAME_FLAG_NONE,
+			GST_VIDEO_INFO_FORMAT(info), GST_VIDEO_INFO_WIDTH(info),
+			GST_VIDEO_INFO_HEIGHT(info), GST_VIDEO_INFO_N_PLANES(info),
+			info->offset, info->stride);
+
+	*buffer = buf;
+
+	return GST_FLOW_OK;
+}
+
+static void
+gbm_pool_finalize(GObject *object)
+{
+	GbmPool *self = (GbmPool *)object;
+
+	gst_object_unref(self->allocator);
+
+	G_OBJECT_CLASS(gbm_pool_parent_class)->finalize(object);
+}
+
+static void
+gbm_pool_class_init(GbmPoolClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS(klass);
+
+	gobject_class->finalize = gbm_pool_finalize;
+	pool_class->get_options = gbm_pool_get_options;
+	pool_class->set_config = gbm_pool_set_config;
+	pool_class->alloc_buffer = gbm_pool_alloc_buffer;
+}
+
+static void
+gbm_pool_init(GbmPool *self)
+{
+	self->allocator = gst_dmabuf_allocator_new();
+}
+
+static GstBufferPool *
+gbm_pool_new(const struct gbm *gbm)
+{
+	GbmPool *self = g_object_new(gbm_pool_get_type(), NULL);
+
+	gst_object_ref_sink(self);
+	self->gbm = gbm;
+
+	return GST_BUFFER_POOL(self);
+}
+
 static GstPadProbeReturn
 appsink_query_cb(GstPad *pad G_GNUC_UNUSED, GstPadProbeInfo *info,
-	gpointer user_data G_GNUC_UNUSED)
+	gpointer user_data)
 {
+	struct decoder *dec = user_data;
 	GstQuery *query = info->data;
+	GstStructure *config;
+	GstBufferPool *pool;
+	GstVideoInfo vinfo;
+	GstCaps *caps;
+	guint min = 0, max = 0;
 
 	if (GST_QUERY_TYPE (query) != GST_QUERY_ALLOCATION)
 	  return GST_PAD_PROBE_OK;
 
 	gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
 
+	gst_query_parse_allocation(query, &caps, NULL);
+	if (!caps || !gst_video_info_from_caps(&vinfo, caps) ||
+	    !drm_format(GST_VIDEO_INFO_FORMAT(&vinfo)))
+		return GST_PAD_PROBE_HANDLED;
+
+	/* The pool buffers are linear bos, which a software decoder writes
+	 * through a mapping that is typically write-combined or uncached,
+	 * and its reads of reference frames from there are much slower
+	 * than from system memory.  There's no asking gbm how the mapping
+	 * will be cached, so only offer the pool to hardware decoders,
+	 * which don't go through the cpu mapping:
+	 */
+	if (!__atomic_load_n(&dec->hw_decoder, __ATOMIC_RELAXED))
+		return GST_PAD_PROBE_HANDLED;
+
+	/* on top of what upstream asked for, the decoder must not run out
+	 * of buffers while the sink holds on to some:
+	 */
+	if (gst_query_get_n_allocation_pools(query) > 0)
+		gst_query_parse_nth_allocation_pool(query, 0, NULL, NULL, &min, &max);
+	min += SINK_HELD_FRAMES;
+	if (max)
+		max = MAX2(max, min);
+
+	pool = gbm_pool_new(dec->gbm);
+	config = gst_buffer_pool_get_config(pool);
+	gst_buffer_pool_config_set_params(config, caps, vinfo.size, min, max);
+	gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+	if (gst_buffer_pool_set_config(pool, config)) {
+		if (gst_query_get_n_allocation_pools(query) > 0)
+			gst_query_set_nth_allocation_pool(query, 0, pool, vinfo.size, min, max);
+		else
+			gst_query_add_allocation_pool(query, pool, vinfo.size, min, max);
+	}
+	gst_object_unref(pool);
+
 	return GST_PAD_PROBE_HANDLED;
 }
 
+#if GST_CHECK_VERSION(1, 24, 0)
+/* Caps for dmabufs in any of the formats and modifiers that EGL can import,
+ * so decoders can hand out tiled or compressed buffers rather than being
+ * held to linear ones.  Returns NULL if there are none.
+ */
+static GstCaps *
+dma_drm_caps(const struct egl *egl)
+{
+	static const uint32_t formats[] = {
+		DRM_FORMAT_YUV420, DRM_FORMAT_NV12, DRM_FORMAT_YUYV,
+	};
+	GValue drm_formats = G_VALUE_INIT;
+	GstCaps *caps = NULL;
+
+	g_value_init(&drm_formats, GST_TYPE_LIST);
+
+	for (unsigned n = 0; n < ARRAY_SIZE(formats); n++) {
+		EGLuint64KHR *modifiers;
+		EGLint num_modifiers = 0;
+
+		if (!egl->eglQueryDmaBufModifiersEXT(egl->display, formats[n], 0,
+				NULL, NULL, &num_modifiers) || !num_modifiers)
+			continue;
+
+		modifiers = calloc(num_modifiers, sizeof(*modifiers));
+		egl->eglQueryDmaBufModifiersEXT(egl->display, formats[n],
+				num_modifiers, modifiers, NULL, &num_modifiers);
+
+		/* external only ones are fine, frames are sampled through
+		 * GL_TEXTURE_EXTERNAL_OES anyway:
+		 */
+		for (EGLint i = 0; i < num_modifiers; i++) {
+			GValue value = G_VALUE_INIT;
+
+			g_value_init(&value, G_TYPE_STRING);
+			g_value_take_string(&value,
+					gst_video_dma_drm_fourcc_to_string(formats[n], modifiers[i]));
+			gst_value_list_append_and_take_value(&drm_formats, &value);
+		}
+
+		free(modifiers);
+	}
+
+	if (gst_value_list_get_size(&drm_formats) > 0) {
+		caps = gst_caps_new_simple("video/x-raw",
+				"format", G_TYPE_STRING, "DMA_DRM", NULL);
+		gst_caps_set_features_simple(caps,
+				gst_caps_features_new(GST_CAPS_FEATURE_MEMORY_DMABUF, NULL));
+		gst_caps_set_value(caps, "drm-format", &drm_formats);
+	}
+
+	g_value_unset(&drm_formats);
+
+	return caps;
+}
+#endif
+
 struct decoder *
 video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
 {
 	struct decoder *dec;
 	GstElement *src, *decodebin;
+	GstCaps *caps;
 	GstPad *pad;
 	GstBus *bus;
 
@@ -268,22 +602,45 @@ video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
 	dec->loop = g_main_loop_new(NULL, FALSE);
 	dec->gbm = gbm;
 	dec->egl = egl;
+	dec->modifier = DRM_FORMAT_MOD_INVALID;
+	dec->use_fences = egl->eglCreateSyncKHR && egl->eglDestroySyncKHR &&
+			egl->eglClientWaitSyncKHR;
 
 	/* Setup pipeline: */
 	static const char *pipeline =
-		"filesrc name=\"src\" ! decodebin name=\"decode\" ! video/x-raw ! appsink sync=false name=\"sink\"";
+		"filesrc name=\"src\" ! decodebin name=\"decode\" ! appsink sync=false name=\"sink\"";
 	dec->pipeline = gst_parse_launch(pipeline, NULL);
 
 	dec->sink = gst_bin_get_by_name(GST_BIN(dec->pipeline), "sink");
 
+	/* Prefer dmabufs with an explicit modifier where GStreamer can
+	 * describe them, then dmabufs in the formats we can import (for
+	 * decoders that don't do DMA_DRM caps yet), and take plain raw
+	 * video otherwise:
+	 */
+	caps = gst_caps_from_string(
+		"video/x-raw(" GST_CAPS_FEATURE_MEMORY_DMABUF "), "
+			"format=(string){ I420, NV12, YUY2 }; "
+		"video/x-raw");
+#if GST_CHECK_VERSION(1, 24, 0)
+	if (egl->eglQueryDmaBufModifiersEXT) {
+		GstCaps *drm_caps = dma_drm_caps(egl);
+		if (drm_caps)
+			caps = gst_caps_merge(drm_caps, caps);
+	}
+#endif
+	gst_app_sink_set_caps(GST_APP_SINK(dec->sink), caps);
+	gst_caps_unref(caps);
+
 	/* Implement the allocation query using a pad probe. This probe will
 	 * adverstize support for GstVideoMeta, which avoid hardware accelerated
 	 * decoder that produce special strides and offsets from having to
-	 * copy the buffers.
+	 * copy the buffers, and offers a pool of gbm buffers to hardware
+	 * decoders.
 	 */
 	pad = gst_element_get_static_pad(dec->sink, "sink");
 	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
-		appsink_query_cb, NULL, NULL);
+		appsink_query_cb, dec, NULL);
 	gst_object_unref(pad);
 
 	src = gst_bin_get_by_name(GST_BIN(dec->pipeline), "src");
@@ -297,7 +654,7 @@ video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
 	/* if we don't limit max-buffers then we can let the decoder outrun
 	 * vsync and quickly chew up 100's of MB of buffers:
 	 */
-	g_object_set(G_OBJECT(dec->sink), "max-buffers", 2, NULL);
+	g_object_set(G_OBJECT(dec->sink), "max-buffers", APPSINK_MAX_BUFFERS, NULL);
 
 	gst_pad_add_probe(gst_element_get_static_pad(dec->sink, "sink"),
 			GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
@@ -322,55 +679,256 @@ video_init(const struct egl *egl, const struct gbm *gbm, const char *filename)
 }
 
 static void
-set_last_frame(struct decoder *dec, EGLImage frame, GstSample *samp)
+set_last_frame(struct decoder *dec, EGLImage frame, bool cached, GstSample *samp)
 {
-	if (dec->last_frame)
+	/* images in the cache stay around for the next time the buffer shows up: */
+	if (dec->last_frame && !dec->last_frame_cached)
 		dec->egl->eglDestroyImageKHR(dec->egl->display, dec->last_frame);
 	dec->last_frame = frame;
+	dec->last_frame_cached = cached;
 	if (dec->last_samp)
 		gst_sample_unref(dec->last_samp);
 	dec->last_samp = samp;
 }
 
-// TODO this could probably be a helper re-used by cube-tex:
-static int
-buf_to_fd(const struct gbm *gbm, int size, void *ptr)
+static void
+flush_images(struct decoder *dec)
 {
-	struct gbm_bo *bo;
+	for (unsigned n = 0; n < MAX_CACHED_IMAGES; n++) {
+		struct cached_image *c = &dec->images[n];
+
+		if (c->image)
+			dec->egl->eglDestroyImageKHR(dec->egl->display, c->image);
+		c->image = EGL_NO_IMAGE_KHR;
+	}
+}
+
+/* Decoders cycle through a small pool of dmabufs, so rather than importing
+ * each frame again, keep the EGLImage of every buffer we've seen.  A dmabuf
+ * is identified by its inode, which can't be handed to another buffer while
+ * our EGLImage still holds a reference to it.  Buffers of a pool that was
+ * torn down simply age out of the cache.
+ *
+ * Returns the entry for the buffer, which has no image yet if it wasn't
+ * found, or NULL if the buffer can't be identified.
+ */
+static struct cached_image *
+lookup_image(struct decoder *dec, const struct plane *planes, unsigned nplanes)
+{
+	struct cached_image *victim = &dec->images[0];
+	struct stat st[MAX_NUM_PLANES];
+	unsigned i, n;
+
+	for (i = 0; i < nplanes; i++) {
+		if (fstat(planes[i].fd, &st[i]))
+			return NULL;
+	}
+
+	for (n = 0; n < MAX_CACHED_IMAGES; n++) {
+		struct cached_image *c = &dec->images[n];
+		bool match = c->image;
+
+		for (i = 0; match && i < nplanes; i++) {
+			match = c->planes[i].dev == st[i].st_dev &&
+					c->planes[i].ino == st[i].st_ino &&
+					c->planes[i].offset == planes[i].offset &&
+					c->planes[i].stride == planes[i].stride;
+		}
+
+		if (match) {
+			c->last_used = dec->frame;
+			return c;
+		}
+
+		/* free slots first, then the least recently used one: */
+		if (!c->image || (victim->image && c->last_used < victim->last_used))
+			victim = c;
+	}
+
+	if (victim->image)
+		dec->egl->eglDestroyImageKHR(dec->egl->display, victim->image);
+
+	victim->image = EGL_NO_IMAGE_KHR;
+	for (i = 0; i < nplanes; i++) {
+		victim->planes[i].dev = st[i].st_dev;
+		victim->planes[i].ino = st[i].st_ino;
+		victim->planes[i].offset = planes[i].offset;
+		victim->planes[i].stride = planes[i].stride;
+	}
+	victim->last_used = dec->frame;
+
+	return victim;
+}
+
+static void
+flush_uploads(struct decoder *dec)
+{
+	const struct egl *egl = dec->egl;
+
+	for (unsigned n = 0; n < NUM_UPLOAD_BOS; n++) {
+		struct upload_bo *u = &dec->uploads[n];
+
+		if (u->fence)
+			egl->eglDestroySyncKHR(egl->display, u->fence);
+		if (u->image)
+			egl->eglDestroyImageKHR(egl->display, u->image);
+		if (u->bo)
+			gbm_bo_destroy(u->bo);
+		memset(u, 0, sizeof(*u));
+	}
+
+	dec->last_upload = NULL;
+}
+
+/* Frames in system memory are copied into a small ring of linear bo's that
+ * stay allocated, each with the EGLImage it was imported as.  A bo is only
+ * written again once the fence placed after the frame it held was drawn
+ * has signalled.
+ */
+static struct upload_bo *
+upload_frame(struct decoder *dec, GstBuffer *buf)
+{
+	const struct egl *egl = dec->egl;
+	struct upload_bo *u = &dec->uploads[dec->next_upload];
+	GstMapInfo map_info;
 	void *map, *map_data = NULL;
 	uint32_t stride;
-	int fd;
 
-	/* NOTE: do not actually use GBM_BO_USE_WRITE since that gets us a dumb buffer: */
-	bo = gbm_bo_create(gbm->dev, size, 1, GBM_FORMAT_R8, GBM_BO_USE_LINEAR);
+	dec->next_upload = (dec->next_upload + 1) % NUM_UPLOAD_BOS;
 
-	map = gbm_bo_map(bo, 0, 0, size, 1, GBM_BO_TRANSFER_WRITE, &stride, &map_data);
+	if (u->fence) {
+		int64_t t = trace_begin();
+		egl->eglClientWaitSyncKHR(egl->display, u->fence, 0, EGL_FOREVER_KHR);
+		trace_end("eglClientWaitSyncKHR", t);
+		egl->eglDestroySyncKHR(egl->display, u->fence);
+		u->fence = NULL;
+	} else if (u->bo && !dec->use_fences) {
+		glFinish();
+	}
 
-	memcpy(map, ptr, size);
+	if (!gst_buffer_map(buf, &map_info, GST_MAP_READ))
+		return NULL;
 
-	gbm_bo_unmap(bo, map_data);
+	if (u->bo && u->size < map_info.size) {
+		egl->eglDestroyImageKHR(egl->display, u->image);
+		gbm_bo_destroy(u->bo);
+		u->image = EGL_NO_IMAGE_KHR;
+		u->bo = NULL;
+	}
 
-	fd = gbm_bo_get_fd(bo);
+	if (!u->bo) {
+		/* NOTE: do not actually use GBM_BO_USE_WRITE since that gets us a dumb buffer: */
+		u->bo = gbm_bo_create(dec->gbm->dev, map_info.size, 1,
+				GBM_FORMAT_R8, GBM_BO_USE_LINEAR);
+		if (!u->bo) {
+			GST_ERROR("could not allocate upload buffer");
+			gst_buffer_unmap(buf, &map_info);
+			return NULL;
+		}
+		u->size = map_info.size;
+	}
 
-	/* we have the fd now, no longer need the bo: */
-	gbm_bo_destroy(bo);
+	map = gbm_bo_map(u->bo, 0, 0, map_info.size, 1, GBM_BO_TRANSFER_WRITE,
+			&stride, &map_data);
+	if (!map) {
+		GST_ERROR("could not map upload buffer");
+		gst_buffer_unmap(buf, &map_info);
+		return NULL;
+	}
+
+	memcpy(map, map_info.data, map_info.size);
+
+	gbm_bo_unmap(u->bo, map_data);
+	gst_buffer_unmap(buf, &map_info);
+
+	dec->last_upload = u;
 
-	return fd;
+	return u;
 }
 
+/* Usually, a videometa should be present, since by using the internal kmscube
+ * video_appsink element instead of the regular appsink, it is guaranteed that
+ * video meta support is declared in the video_appsink's allocation query.
+ * However, this assumes that upstream elements actually look at the allocation
+ * query's contents properly, or that they even send a query at all. If this
+ * is not the case, then upstream might decide to push frames without adding
+ * a meta. It can happen, and in this case, look at the video info data as
+ * a fallback (it is computed out of the input caps).
+ */
+static guint
+frame_planes(const struct decoder *dec, const GstVideoMeta *meta)
+{
+	if (meta)
+		return MIN(meta->n_planes, MAX_NUM_PLANES);
+
+	/* none for dma-drm caps, whose layout only a video meta describes: */
+	return GST_VIDEO_INFO_N_PLANES(&(dec->info));
+}
+
+static void
+plane_layout(const struct decoder *dec, const GstVideoMeta *meta, guint i,
+		struct plane *plane)
+{
+	if (meta) {
+		plane->offset = meta->offset[i];
+		plane->stride = meta->stride[i];
+	} else {
+		plane->offset = GST_VIDEO_INFO_PLANE_OFFSET(&(dec->info), i);
+		plane->stride = GST_VIDEO_INFO_PLANE_STRIDE(&(dec->info), i);
+	}
+}
+
+/* Find the dmabuf holding each plane of the frame.  Decoders may put all
+ * planes in one dmabuf, or each in its own (separate luma and chroma
+ * buffers for NV12 are common), so look up the memory by plane offset.
+ * Returns the number of planes, or 0 unless every plane is in dmabuf
+ * memory.
+ */
+static guint
+dmabuf_planes(const struct decoder *dec, GstBuffer *buf, struct plane *planes)
+{
+	GstVideoMeta *meta = gst_buffer_get_video_meta(buf);
+	guint nplanes = frame_planes(dec, meta);
+
+	for (guint i = 0; i < nplanes; i++) {
+		GstMemory *mem;
+		guint idx, length;
+		gsize skip;
+
+		plane_layout(dec, meta, i, &planes[i]);
+
+		if (!gst_buffer_find_memory(buf, planes[i].offset, 1,
+				&idx, &length, &skip))
+			return 0;
+
+		mem = gst_buffer_peek_memory(buf, idx);
+		if (!gst_is_dmabuf_memory(mem))
+			return 0;
+
+		/* EGL takes its own reference, no need to dup: */
+		planes[i].fd = gst_dmabuf_memory_get_fd(mem);
+		planes[i].offset = mem->offset + skip;
+	}
+
+	return nplanes;
+}
+
+/* Sets *cached when the returned image belongs to the image cache, and
+ * *reused when it was found there rather than imported.
+ */
 static EGLImage
-buffer_to_image(struct decoder *dec, GstBuffer *buf)
+buffer_to_image(struct decoder *dec, GstBuffer *buf, bool *cached, bool *reused)
 {
-	struct { int fd, offset, stride; } planes[MAX_NUM_PLANES];
+	struct plane planes[MAX_NUM_PLANES];
+	struct cached_image *entry = NULL;
+	struct upload_bo *upload = NULL;
 	GstVideoMeta *meta = gst_buffer_get_video_meta(buf);
 	EGLImage image;
-	guint nmems = gst_buffer_n_memory(buf);
-	guint nplanes = GST_VIDEO_INFO_N_PLANES(&(dec->info));
+	guint nplanes;
 	guint i;
 	guint width, height;
 	gboolean is_dmabuf_mem;
-	GstMemory *mem;
-	int dmabuf_fd = -1;
+	int upload_fd = -1;
 
 	static const EGLint egl_dmabuf_plane_fd_attr[MAX_NUM_PLANES] = {
 		EGL_DMA_BUF_PLANE0_FD_EXT,
@@ -387,61 +945,52 @@ buffer_to_image(struct decoder *dec, GstBuffer *buf)
 		EGL_DMA_BUF_PLANE1_PITCH_EXT,
 		EGL_DMA_BUF_PLANE2_PITCH_EXT,
 	};
+	static const EGLint egl_dmabuf_plane_modifier_lo_attr[MAX_NUM_PLANES] = {
+		EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+		EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+		EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+	};
+	static const EGLint egl_dmabuf_plane_modifier_hi_attr[MAX_NUM_PLANES] = {
+		EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT,
+		EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT,
+		EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT,
+	};
 
-	/* Query gst_is_dmabuf_memory() here, since the gstmemory
-	 * block might get merged below by gst_buffer_map(), meaning
-	 * that the mem pointer would become invalid */
-	mem = gst_buffer_peek_memory(buf, 0);
-	is_dmabuf_mem = gst_is_dmabuf_memory(mem);
+	/* Look for the dmabufs here, since the gstmemory blocks might
+	 * get merged below by gst_buffer_map(), meaning that the memory
+	 * pointers would become invalid */
+	nplanes = dmabuf_planes(dec, buf, planes);
+	is_dmabuf_mem = nplanes > 0;
 
-	if (nmems > 1) {
-		if (is_dmabuf_mem) {
-			/* this case currently is not defined */
+	*cached = *reused = false;
 
-			GST_FIXME("gstbuffers with multiple memory blocks and DMABUF "
-			          "memory currently are not supported");
+	if (!is_dmabuf_mem) {
+		nplanes = frame_planes(dec, meta);
+		if (!nplanes) {
+			GST_ERROR("no video meta to describe the frame layout");
 			return EGL_NO_IMAGE_KHR;
 		}
 
-		/* if this is not DMABUF memory, then the gst_buffer_map()
-		 * call below will automatically merge the memory blocks
+		/* gst_buffer_map() merges multiple memory blocks, so the
+		 * planes are where the video meta says in the upload bo:
 		 */
-	}
-
-	if (is_dmabuf_mem) {
-		dmabuf_fd = dup(gst_dmabuf_memory_get_fd(mem));
-	} else {
-		GstMapInfo map_info;
-		gst_buffer_map(buf, &map_info, GST_MAP_READ);
-		dmabuf_fd = buf_to_fd(dec->gbm, map_info.size, map_info.data);
-		gst_buffer_unmap(buf, &map_info);
-	}
-
-	if (dmabuf_fd < 0) {
-		GST_ERROR("could not obtain DMABUF FD");
-		return EGL_NO_IMAGE_KHR;
-	}
+		upload = upload_frame(dec, buf);
+		if (!upload)
+			return EGL_NO_IMAGE_KHR;
+		if (upload->image) {
+			*cached = *reused = true;
+			return upload->image;
+		}
 
-	/* Usually, a videometa should be present, since by using the internal kmscube
-	 * video_appsink element instead of the regular appsink, it is guaranteed that
-	 * video meta support is declared in the video_appsink's allocation query.
-	 * However, this assumes that upstream elements actually look at the allocation
-	 * query's contents properly, or that they even send a query at all. If this
-	 * is not the case, then upstream might decide to push frames without adding
-	 * a meta. It can happen, and in this case, look at the video info data as
-	 * a fallback (it is computed out of the input caps).
-	 */
-	if (meta) {
-		for (i = 0; i < nplanes; i++) {
-			planes[i].fd = dmabuf_fd;
-			planes[i].offset = meta->offset[i];
-			planes[i].stride = meta->stride[i];
+		upload_fd = gbm_bo_get_fd(upload->bo);
+		if (upload_fd < 0) {
+			GST_ERROR("could not obtain DMABUF FD");
+			return EGL_NO_IMAGE_KHR;
 		}
-	} else {
+
 		for (i = 0; i < nplanes; i++) {
-			planes[i].fd = dmabuf_fd;
-			planes[i].offset = GST_VIDEO_INFO_PLANE_OFFSET(&(dec->info), i);
-			planes[i].stride = GST_VIDEO_INFO_PLANE_STRIDE(&(dec->info), i);
+			planes[i].fd = upload_fd;
+			plane_layout(dec, meta, i, &planes[i]);
 		}
 	}
 
@@ -465,33 +1014,59 @@ buffer_to_image(struct decoder *dec, GstBuffer *buf)
 		printf("===================================\n");
 	}
 
+	if (is_dmabuf_mem) {
+		entry = lookup_image(dec, planes, nplanes);
+		if (entry && entry->image) {
+			*cached = *reused = true;
+			return entry->image;
+		}
+	}
+
 	{
 		/* Initialize the first 6 attributes with values that are
 		 * plane invariant (width, height, format) */
-		EGLint attr[6 + 6*(MAX_NUM_PLANES) + 1] = {
+		EGLint attr[6 + 10*(MAX_NUM_PLANES) + 1] = {
 			EGL_WIDTH, width,
 			EGL_HEIGHT, height,
 			EGL_LINUX_DRM_FOURCC_EXT, dec->format
 		};
+		/* the upload bo's are linear, as is anything without one: */
+		bool use_modifier = is_dmabuf_mem && dec->egl->modifiers_supported &&
+				dec->modifier != DRM_FORMAT_MOD_INVALID;
+		unsigned n = 6;
 
 		for (i = 0; i < nplanes; i++) {
-			attr[6 + 6*i + 0] = egl_dmabuf_plane_fd_attr[i];
-			attr[6 + 6*i + 1] = planes[i].fd;
-			attr[6 + 6*i + 2] = egl_dmabuf_plane_offset_attr[i];
-			attr[6 + 6*i + 3] = planes[i].offset;
-			attr[6 + 6*i + 4] = egl_dmabuf_plane_pitch_attr[i];
-			attr[6 + 6*i + 5] = planes[i].stride;
+			attr[n++] = egl_dmabuf_plane_fd_attr[i];
+			attr[n++] = planes[i].fd;
+			attr[n++] = egl_dmabuf_plane_offset_attr[i];
+			attr[n++] = planes[i].offset;
+			attr[n++] = egl_dmabuf_plane_pitch_attr[i];
+			attr[n++] = planes[i].stride;
+			if (use_modifier) {
+				attr[n++] = egl_dmabuf_plane_modifier_lo_attr[i];
+				attr[n++] = dec->modifier & 0xffffffff;
+				attr[n++] = egl_dmabuf_plane_modifier_hi_attr[i];
+				attr[n++] = dec->modifier >> 32;
+			}
 		}
 
-		attr[6 + 6*nplanes] = EGL_NONE;
+		attr[n] = EGL_NONE;
 
 		image = dec->egl->eglCreateImageKHR(dec->egl->display, EGL_NO_CONTEXT,
 				EGL_LINUX_DMA_BUF_EXT, NULL, attr);
 	}
 
+	if (entry && image != EGL_NO_IMAGE_KHR) {
+		entry->image = image;
+		*cached = true;
+	} else if (upload && image != EGL_NO_IMAGE_KHR) {
+		upload->image = image;
+		*cached = true;
+	}
+
 	/* Cleanup */
-	for (unsigned i = 0; i < nplanes; i++)
-		close(planes[i].fd);
+	if (upload_fd >= 0)
+		close(upload_fd);
 
 	return image;
 }
@@ -502,6 +1077,8 @@ video_frame(struct decoder *dec)
 	GstSample *samp;
 	GstBuffer *buf;
 	EGLImage   frame = NULL;
+	int64_t    start, end;
+	bool       cached, reused;
 
 	samp = gst_app_sink_pull_sample(GST_APP_SINK(dec->sink));
 	if (!samp) {
@@ -511,22 +1088,126 @@ video_frame(struct decoder *dec)
 
 	buf = gst_sample_get_buffer(samp);
 
-	// TODO inline buffer_to_image??
-	frame = buffer_to_image(dec, buf);
+	/* the previous frame has been drawn by now: */
+	if (dec->last_upload && dec->use_fences) {
+		dec->last_upload->fence = dec->egl->eglCreateSyncKHR(dec->egl->display,
+				EGL_SYNC_FENCE_KHR, NULL);
+	}
+	dec->last_upload = NULL;
+
+	if (__atomic_exchange_n(&dec->caps_changed, false, __ATOMIC_ACQUIRE)) {
+		/* the current frame may be one of them, but it is already
+		 * bound to the texture, which keeps its own reference:
+		 */
+		flush_images(dec);
+		flush_uploads(dec);
+	}
+
+	start = get_time_ns();
+	frame = buffer_to_image(dec, buf, &cached, &reused);
+	end = get_time_ns();
+	trace_span("import frame", start, end);
 
-	// TODO in the zero-copy dmabuf case it would be nice to associate
-	// the eglimg w/ the buffer to avoid recreating it every frame..
+	dec->import_ns[reused] += end - start;
+	dec->imports[reused]++;
 
-	set_last_frame(dec, frame, samp);
+	set_last_frame(dec, frame, cached, samp);
 
 	dec->frame++;
 
 	return frame;
 }
 
+/* The frame last returned by video_frame(), imported as a bo that can be
+ * put on a plane, or NULL if it is not in dmabuf memory or the display
+ * can't import it.  Hand it back with video_release_bo().
+ */
+struct gbm_bo *
+video_frame_bo(struct decoder *dec)
+{
+	struct gbm_import_fd_modifier_data data = {
+		.width = GST_VIDEO_INFO_WIDTH(&dec->info),
+		.height = GST_VIDEO_INFO_HEIGHT(&dec->info),
+		.format = dec->format,
+		/* from the caps, or whatever layout the decoder and the
+		 * display agree on:
+		 */
+		.modifier = dec->modifier,
+	};
+	struct plane planes[MAX_NUM_PLANES];
+	struct gbm_bo *bo;
+	unsigned slot;
+
+	if (!dec->last_samp)
+		return NULL;
+
+	data.num_fds = dmabuf_planes(dec, gst_sample_get_buffer(dec->last_samp),
+			planes);
+	if (!data.num_fds)
+		return NULL;
+
+	for (slot = 0; slot < MAX_SCANOUT_FRAMES; slot++) {
+		if (!scanout_frames[slot].bo)
+			break;
+	}
+	if (slot == MAX_SCANOUT_FRAMES) {
+		GST_WARNING("too many frames held for scanout");
+		return NULL;
+	}
+
+	for (int i = 0; i < data.num_fds; i++) {
+		data.fds[i] = planes[i].fd;
+		data.offsets[i] = planes[i].offset;
+		data.strides[i] = planes[i].stride;
+	}
+
+	bo = gbm_bo_import(dec->gbm->dev, GBM_BO_IMPORT_FD_MODIFIER, &data,
+			GBM_BO_USE_SCANOUT);
+	if (!bo) {
+		GST_DEBUG("could not import frame for scanout");
+		return NULL;
+	}
+
+	scanout_frames[slot].bo = bo;
+	scanout_frames[slot].samp = gst_sample_ref(dec->last_samp);
+
+	return bo;
+}
+
+void
+video_release_bo(struct gbm_bo *bo)
+{
+	for (unsigned slot = 0; slot < MAX_SCANOUT_FRAMES; slot++) {
+		if (scanout_frames[slot].bo != bo)
+			continue;
+
+		gbm_bo_destroy(bo);
+		gst_sample_unref(scanout_frames[slot].samp);
+		scanout_frames[slot].bo = NULL;
+		scanout_frames[slot].samp = NULL;
+		return;
+	}
+}
+
+static void
+report_imports(struct decoder *dec)
+{
+	for (unsigned i = 0; i < 2; i++) {
+		if (!dec->imports[i])
+			continue;
+		printf("%s %u frames, avg %.1f us per frame\n",
+				i ? "Reused EGLImage for" : "Imported",
+				dec->imports[i],
+				(double)dec->import_ns[i] / dec->imports[i] / 1000.0);
+	}
+}
+
 void video_deinit(struct decoder *dec)
 {
-	set_last_frame(dec, NULL, NULL);
+	report_imports(dec);
+	set_last_frame(dec, NULL, false, NULL);
+	flush_images(dec);
+	flush_uploads(dec);
 	gst_element_set_state(dec->pipeline, GST_STATE_NULL);
 	gst_object_unref(dec->sink);
 	gst_object_unref(dec->pipeline);
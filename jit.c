@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2020 The kmscube authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "drm-common.h"
+
+/* Just-in-time render scheduling.
+ *
+ * Without it, the next frame is started as soon as the previous flip
+ * completes, so what ends up on screen was rendered almost a full
+ * refresh earlier.  Instead, predict the next vblank from the kernel's
+ * flip timestamps, and start rendering only render cost + margin before
+ * it.  The render cost (from starting to draw until the gpu is done) is
+ * tracked with a moving average that follows increases immediately, as
+ * under-estimating it means a missed vblank while over-estimating only
+ * costs a bit of latency.
+ *
+ * Whether or not it is enabled, the time from starting to render a frame
+ * until it is scanned out is recorded, so runs with and without it can
+ * be compared.
+ */
+
+struct jit {
+	bool enabled;
+	int64_t refresh_ns, margin_ns;
+
+	int64_t cost_ns;           /* estimated render start to gpu done */
+	int64_t start_time;        /* when to start rendering the next frame */
+
+	/* render start to scanout: */
+	int64_t latency_sum, latency_max;
+	unsigned latency_count;
+};
+
+struct jit * jit_new(const drmModeModeInfo *mode, bool enabled, int64_t margin_ns)
+{
+	struct jit *j = calloc(1, sizeof(*j));
+
+	if (!j)
+		return NULL;
+
+	j->enabled = enabled;
+	j->margin_ns = margin_ns;
+	j->refresh_ns = mode_refresh_ns(mode);
+
+	return j;
+}
+
+void jit_free(struct jit *j)
+{
+	free(j);
+}
+
+bool jit_enabled(const struct jit *j)
+{
+	return j->enabled;
+}
+
+int64_t jit_start_time(const struct jit *j)
+{
+	return j->start_time;
+}
+
+void jit_frame_done(struct jit *j, int64_t render_start, int64_t gpu_done,
+		int64_t scanout)
+{
+	if (gpu_done > render_start) {
+		int64_t cost = gpu_done - render_start;
+
+		if (cost > j->cost_ns)
+			j->cost_ns = cost;
+		else
+			j->cost_ns += (cost - j->cost_ns) / 16;
+	}
+
+	if (scanout > render_start) {
+		int64_t latency = scanout - render_start;
+
+		j->latency_sum += latency;
+		j->latency_max = MAX2(j->latency_max, latency);
+		j->latency_count++;
+	}
+}
+
+void jit_vblank(struct jit *j, int64_t vblank_time)
+{
+	if (!j->enabled || !j->refresh_ns)
+		return;
+
+	/* the next frame goes out at the following vblank: */
+	j->start_time = vblank_time + j->refresh_ns - j->cost_ns - j->margin_ns;
+}
+
+void jit_report(const struct jit *j)
+{
+	if (!j->latency_count)
+		return;
+
+	printf("Render to scanout latency: avg %.3f ms, max %.3f ms",
+		(double)j->latency_sum / j->latency_count / (NSEC_PER_SEC / MSEC_PER_SEC),
+		(double)j->latency_max / (NSEC_PER_SEC / MSEC_PER_SEC));
+	if (j->enabled)
+		printf("  (just-in-time, render cost %.3f ms, margin %.3f ms)",
+			(double)j->cost_ns / (NSEC_PER_SEC / MSEC_PER_SEC),
+			(double)j->margin_ns / (NSEC_PER_SEC / MSEC_PER_SEC));
+	printf("\n");
+}
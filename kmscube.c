@@ -24,6 +24,7 @@
 
 /* Based on a egl cube test app originally written by Arvin Schnell */
 
+#include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,69 +42,493 @@ static const struct egl *egl;
 static const struct gbm *gbm;
 static const struct drm *drm;
 
-static const char *shortopts = "Ac:D:f:M:m:p:S:s:V:v:x";
+/* frames rendered before each run of a sweep is measured, and measured
+ * when no count is given:
+ */
+#define SWEEP_WARMUP_FRAMES   60
+#define SWEEP_DEFAULT_FRAMES  600
+
+#define MAX_SWEEP_VALUES 16
+
+enum sweep_axis {
+	SWEEP_MODE,
+	SWEEP_SAMPLES,
+	SWEEP_FORMAT,
+	SWEEP_MODIFIER,
+	SWEEP_BUFFERS,
+	NUM_SWEEP_AXES
+};
+
+static const char *sweep_axis_names[NUM_SWEEP_AXES] = {
+	[SWEEP_MODE]     = "mode",
+	[SWEEP_SAMPLES]  = "samples",
+	[SWEEP_FORMAT]   = "format",
+	[SWEEP_MODIFIER] = "modifier",
+	[SWEEP_BUFFERS]  = "buffers",
+};
+
+/* the values given for each axis with --sweep: */
+static struct {
+	const char *values[MAX_SWEEP_VALUES];
+	unsigned count;
+} sweep[NUM_SWEEP_AXES];
+
+static const char *mode_names[] = {
+	[SMOOTH]    = "smooth",
+	[RGBA]      = "rgba",
+	[NV12_2IMG] = "nv12-2img",
+	[NV12_1IMG] = "nv12-1img",
+	[VIDEO]     = "video",
+	[SHADERTOY] = "shadertoy",
+};
+
+/* Everything a run needs, on top of the drm device (which is set up
+ * once and shared by all the runs of a sweep):
+ */
+struct run_config {
+	enum mode mode;
+	int samples;
+	uint32_t format;
+	uint64_t modifier;      /* DRM_FORMAT_MOD_INVALID if not hardcoded */
+	unsigned num_buffers;
+	bool surfaceless;
+	bool video_plane;
+	const char *video;
+	const char *shadertoy;
+	const char *perfcntr;
+};
+
+static const char *shortopts = "aAB:b:C:c:D:F:f:J:kLM:m:OP:p:S:s:T:V:v:w:x";
 
 static const struct option longopts[] = {
+	{"all-outputs", no_argument,  0, 'a'},
 	{"atomic", no_argument,       0, 'A'},
+	{"sweep",  required_argument, 0, 'B'},
+	{"buffers", required_argument, 0, 'b'},
+	{"stop-cv", required_argument, 0, 'C'},
 	{"count",  required_argument, 0, 'c'},
 	{"device", required_argument, 0, 'D'},
+	{"stats",  required_argument, 0, 'F'},
 	{"format", required_argument, 0, 'f'},
+	{"jit",    required_argument, 0, 'J'},
+	{"probe-cache", no_argument,  0, 'k'},
+	{"video-plane", no_argument,  0, 'L'},
 	{"mode",   required_argument, 0, 'M'},
 	{"modifier", required_argument, 0, 'm'},
+	{"offscreen", no_argument,    0, 'O'},
+	{"present", required_argument, 0, 'P'},
 	{"perfcntr", required_argument, 0, 'p'},
 	{"samples",  required_argument, 0, 's'},
+	{"trace",  required_argument, 0, 'T'},
 	{"video",  required_argument, 0, 'V'},
 	{"vmode",  required_argument, 0, 'v'},
+	{"warmup", required_argument, 0, 'w'},
 	{"surfaceless", no_argument,  0, 'x'},
 	{0, 0, 0, 0}
 };
 
 static void usage(const char *name)
 {
-	printf("Usage: %s [-ADfMmSsVvx]\n"
+	printf("Usage: %s [-aABbCcDFfJkLMmOPSsTVvwx]\n"
 			"\n"
 			"options:\n"
+			"    -a, --all-outputs        drive every connected output at once (atomic)\n"
 			"    -A, --atomic             use atomic modesetting and fencing\n"
+			"    -B, --sweep=AXIS=LIST    run once for every combination of the comma\n"
+			"                             separated values of each AXIS given, one of\n"
+			"                             mode, samples, format, modifier (or auto)\n"
+			"                             and buffers, and print one JSON record per\n"
+			"                             run (-c sets the frames measured, default %u)\n"
+			"    -b, --buffers=N          number of buffers to render into (2-8, default 2),\n"
+			"                             more lets the gpu run ahead of scanout (atomic)\n"
+			"    -C, --stop-cv=PERCENT    stop once the coefficient of variation of the\n"
+			"                             last frame times is below PERCENT\n"
 			"    -c, --count              run for the specified number of frames\n"
 			"    -D, --device=DEVICE      use the given device\n"
+			"    -F, --stats=FORMAT       frame time statistics output format, one of:\n"
+			"        text      -  human readable (default)\n"
+			"        json      -  one JSON object per report\n"
+			"        csv       -  one CSV line per report\n"
 			"    -f, --format=FOURCC      framebuffer format\n"
+			"    -J, --jit=MARGIN_US      start rendering each frame just in time for\n"
+			"                             the next vblank, with a safety margin of\n"
+			"                             MARGIN_US microseconds (fifo present mode)\n"
+			"    -k, --probe-cache        try the device, connector and plane of the\n"
+			"                             last run first, to start up faster\n"
+			"    -L, --video-plane        scan the video out on a plane under the cube,\n"
+			"                             instead of drawing it (atomic, video mode)\n"
 			"    -M, --mode=MODE          specify mode, one of:\n"
 			"        smooth    -  smooth shaded cube (default)\n"
 			"        rgba      -  rgba textured cube\n"
 			"        nv12-2img -  yuv textured (color conversion in shader)\n"
 			"        nv12-1img -  yuv textured (single nv12 texture)\n"
-			"    -m, --modifier=MODIFIER  hardcode the selected modifier\n"
+			"    -m, --modifier=MODIFIER  hardcode the selected modifier (default: any\n"
+			"                             the plane supports with atomic, else linear)\n"
+			"    -O, --offscreen          render to offscreen buffers on a render node,\n"
+			"                             without a display (--vmode=WxH sets the size)\n"
+			"    -P, --present=MODE       presentation mode, one of:\n"
+			"        fifo      -  show every frame, one per vblank (default)\n"
+			"        mailbox   -  render unthrottled, show the newest finished\n"
+			"                     frame at each vblank (atomic, needs 3+ buffers)\n"
+			"        async     -  flip without waiting for vblank (tears), to\n"
+			"                     measure rendering above the refresh rate\n"
 			"    -p, --perfcntr=LIST      sample specified performance counters using\n"
 			"                             the AMD_performance_monitor extension (comma\n"
 			"                             separated list, shadertoy mode only)\n"
 			"    -S, --shadertoy=FILE     use specified shadertoy shader\n"
 			"    -s, --samples=N          use MSAA\n"
+			"    -T, --trace=FILE         write a timeline of the frame loop to FILE\n"
+			"                             in Chrome trace (chrome://tracing) format\n"
 			"    -V, --video=FILE         video textured cube (comma separated list)\n"
 			"    -v, --vmode=VMODE        specify the video mode in the format\n"
 			"                             <mode>[-<vrefresh>]\n"
+			"    -w, --warmup=N[s]        frames (or with an s suffix, seconds) to run\n"
+			"                             before measuring (default 1 frame, %u with\n"
+			"                             --sweep)\n"
 			"    -x, --surfaceless        use surfaceless mode, instead of gbm surface\n"
 			,
-			name);
+			name, SWEEP_DEFAULT_FRAMES, SWEEP_WARMUP_FRAMES);
+}
+
+static int parse_mode(const char *str, enum mode *mode)
+{
+	/* video and shadertoy need a file, and have options of their own: */
+	for (unsigned i = SMOOTH; i <= NV12_1IMG; i++) {
+		if (strcmp(str, mode_names[i]) == 0) {
+			*mode = i;
+			return 0;
+		}
+	}
+
+	printf("invalid mode: %s\n", str);
+	return -1;
+}
+
+static uint32_t parse_format(const char *str)
+{
+	char fourcc[4] = "    ";
+	int length = strlen(str);
+	if (length > 0)
+		fourcc[0] = str[0];
+	if (length > 1)
+		fourcc[1] = str[1];
+	if (length > 2)
+		fourcc[2] = str[2];
+	if (length > 3)
+		fourcc[3] = str[3];
+	return fourcc_code(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+}
+
+/* The format with an alpha channel to use instead of the given one, which
+ * is either the format itself or its variant with alpha in place of the
+ * padding, or 0 if there is none:
+ */
+static uint32_t alpha_format(uint32_t format)
+{
+	static const struct {
+		uint32_t opaque, alpha;
+	} formats[] = {
+		{ DRM_FORMAT_XRGB8888,    DRM_FORMAT_ARGB8888 },
+		{ DRM_FORMAT_XBGR8888,    DRM_FORMAT_ABGR8888 },
+		{ DRM_FORMAT_RGBX8888,    DRM_FORMAT_RGBA8888 },
+		{ DRM_FORMAT_BGRX8888,    DRM_FORMAT_BGRA8888 },
+		{ DRM_FORMAT_XRGB2101010, DRM_FORMAT_ARGB2101010 },
+		{ DRM_FORMAT_XBGR2101010, DRM_FORMAT_ABGR2101010 },
+		{ DRM_FORMAT_RGBX1010102, DRM_FORMAT_RGBA1010102 },
+		{ DRM_FORMAT_BGRX1010102, DRM_FORMAT_BGRA1010102 },
+		{ DRM_FORMAT_XRGB1555,    DRM_FORMAT_ARGB1555 },
+		{ DRM_FORMAT_XRGB4444,    DRM_FORMAT_ARGB4444 },
+	};
+
+	for (unsigned i = 0; i < ARRAY_SIZE(formats); i++) {
+		if (format == formats[i].opaque || format == formats[i].alpha)
+			return formats[i].alpha;
+	}
+
+	return 0;
+}
+
+static int parse_buffers(const char *str, unsigned *num_buffers)
+{
+	*num_buffers = strtoul(str, NULL, 0);
+	if (*num_buffers < 2 || *num_buffers > MAX_NUM_BUFFERS) {
+		printf("invalid number of buffers: %s\n", str);
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_jit_margin(const char *str, int64_t *margin_ns)
+{
+	char *end;
+	long us = strtol(str, &end, 0);
+
+	/* more than a second ahead can't be meant as just in time: */
+	if (end == str || *end || us < 0 || us > USEC_PER_SEC) {
+		printf("invalid just in time margin: %s\n", str);
+		return -1;
+	}
+	*margin_ns = us * (NSEC_PER_SEC / USEC_PER_SEC);
+	return 0;
+}
+
+static int parse_stop_cv(const char *str, double *cv)
+{
+	char *end;
+	double percent = strtod(str, &end);
+
+	if (end == str || *end || !(percent > 0 && percent < 100)) {
+		printf("invalid coefficient of variation: %s\n", str);
+		return -1;
+	}
+	*cv = percent / 100;
+	return 0;
+}
+
+static int set_sweep_value(struct run_config *config, enum sweep_axis axis,
+		const char *value)
+{
+	switch (axis) {
+	case SWEEP_MODE:
+		if (strcmp(value, "shadertoy") == 0) {
+			if (!config->shadertoy) {
+				printf("sweeping shadertoy mode needs --shadertoy\n");
+				return -1;
+			}
+			config->mode = SHADERTOY;
+			return 0;
+		}
+		return parse_mode(value, &config->mode);
+	case SWEEP_SAMPLES:
+		config->samples = strtoul(value, NULL, 0);
+		return 0;
+	case SWEEP_FORMAT:
+		config->format = parse_format(value);
+		return 0;
+	case SWEEP_MODIFIER:
+		if (strcmp(value, "auto") == 0)
+			config->modifier = DRM_FORMAT_MOD_INVALID;
+		else
+			config->modifier = strtoull(value, NULL, 0);
+		return 0;
+	case SWEEP_BUFFERS:
+		return parse_buffers(value, &config->num_buffers);
+	default:
+		return -1;
+	}
+}
+
+/* --sweep=AXIS=V1,V2,...: */
+static int add_sweep(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	char *values, *value, *saveptr;
+	unsigned axis;
+
+	for (axis = 0; axis < NUM_SWEEP_AXES; axis++) {
+		if (eq && strlen(sweep_axis_names[axis]) == (size_t)(eq - arg) &&
+		    strncmp(arg, sweep_axis_names[axis], eq - arg) == 0)
+			break;
+	}
+	if (axis == NUM_SWEEP_AXES) {
+		printf("invalid sweep: %s\n", arg);
+		return -1;
+	}
+
+	values = strdup(eq + 1);
+	for (value = strtok_r(values, ",", &saveptr); value;
+	     value = strtok_r(NULL, ",", &saveptr)) {
+		if (sweep[axis].count == MAX_SWEEP_VALUES) {
+			printf("too many values to sweep %s\n", sweep_axis_names[axis]);
+			return -1;
+		}
+		sweep[axis].values[sweep[axis].count++] = value;
+	}
+
+	if (!sweep[axis].count) {
+		printf("no values to sweep %s\n", sweep_axis_names[axis]);
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool sweeping(void)
+{
+	for (unsigned axis = 0; axis < NUM_SWEEP_AXES; axis++) {
+		if (sweep[axis].count)
+			return true;
+	}
+	return false;
+}
+
+/* Number of buffers a run of the config actually uses.  Mailbox needs
+ * one buffer on screen, one being rendered and one to hold the newest
+ * finished frame:
+ */
+static unsigned run_buffers(const struct run_config *config)
+{
+	if (drm->present == PRESENT_MAILBOX && config->num_buffers < 3)
+		return 3;
+	return config->num_buffers;
+}
+
+/* Set up gbm and egl for the config, and run the frame loop: */
+static int run(const struct run_config *config)
+{
+	/* static, as gbm keeps pointing at the list it was created with: */
+	static uint64_t modifier;
+	const uint64_t *modifiers = &modifier;
+	unsigned num_modifiers = 1;
+	unsigned num_buffers = run_buffers(config);
+	const uint64_t *plane_modifiers;
+	unsigned num_plane_modifiers = 0;
+
+	gbm = NULL;
+	egl = NULL;
+
+	modifier = config->modifier;
+	if (modifier == DRM_FORMAT_MOD_INVALID && drm->get_modifiers)
+		num_plane_modifiers = drm->get_modifiers(config->format, &plane_modifiers);
+
+	/* let the driver pick the best layout the display can scan out: */
+	if (modifier == DRM_FORMAT_MOD_INVALID && num_plane_modifiers) {
+		modifiers = plane_modifiers;
+		num_modifiers = num_plane_modifiers;
+		printf("Choosing from %u modifiers supported by the plane\n", num_modifiers);
+	} else if (modifier == DRM_FORMAT_MOD_INVALID) {
+		modifier = DRM_FORMAT_MOD_LINEAR;
+	}
+
+	if (num_buffers != config->num_buffers)
+		printf("mailbox presentation needs at least 3 buffers, using 3\n");
+
+	gbm = init_gbm(drm->fd, drm->mode->hdisplay, drm->mode->vdisplay,
+			config->format, modifiers, num_modifiers,
+			config->surfaceless, !drm->offscreen, num_buffers);
+	if (!gbm) {
+		printf("failed to initialize GBM\n");
+		return -1;
+	}
+	startup_phase("gbm");
+
+	if (config->mode == SMOOTH)
+		egl = init_cube_smooth(gbm, config->samples);
+	else if (config->mode == VIDEO)
+		egl = init_cube_video(gbm, config->video, config->samples,
+				config->video_plane);
+	else if (config->mode == SHADERTOY)
+		egl = init_cube_shadertoy(gbm, config->shadertoy, config->samples);
+	else
+		egl = init_cube_tex(gbm, config->mode, config->samples);
+
+	if (!egl) {
+		printf("failed to initialize EGL\n");
+		return -1;
+	}
+
+	program_cache_report();
+	startup_phase("cube");
+
+	if (config->perfcntr) {
+		if (config->mode != SHADERTOY) {
+			printf("performance counters only supported in shadertoy mode\n");
+			return -1;
+		}
+		init_perfcntrs(egl, config->perfcntr);
+	}
+
+	/* clear the color buffer */
+	glClearColor(0.5, 0.5, 0.5, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	return drm->run(gbm, egl);
+}
+
+/* Run every combination of the swept values, the first axis changing
+ * fastest.  A run that fails (ie. a format or sample count the driver
+ * doesn't support) doesn't stop the others:
+ */
+static int run_sweep(const struct run_config *base)
+{
+	unsigned index[NUM_SWEEP_AXES] = { 0 };
+	int ret = 0;
+
+	while (true) {
+		struct run_config config = *base;
+		char modifier[24], fields[256];
+		unsigned axis;
+
+		for (axis = 0; axis < NUM_SWEEP_AXES; axis++) {
+			if (sweep[axis].count)
+				set_sweep_value(&config, axis,
+						sweep[axis].values[index[axis]]);
+		}
+
+		if (config.modifier == DRM_FORMAT_MOD_INVALID)
+			strcpy(modifier, "auto");
+		else
+			snprintf(modifier, sizeof(modifier), "0x%" PRIx64, config.modifier);
+
+		snprintf(fields, sizeof(fields),
+			"\"mode\": \"%s\", \"samples\": %d, \"format\": \"%c%c%c%c\", "
+			"\"modifier\": \"%s\", \"buffers\": %u",
+			mode_names[config.mode], config.samples,
+			config.format & 0xff, (config.format >> 8) & 0xff,
+			(config.format >> 16) & 0xff, (config.format >> 24) & 0xff,
+			modifier, run_buffers(&config));
+		stats_set_run(fields);
+
+		if (run(&config)) {
+			printf("run failed: %s\n", fields);
+			ret = -1;
+		}
+
+		if (egl)
+			fini_egl(egl);
+		if (gbm)
+			fini_gbm(gbm);
+
+		/* next combination: */
+		for (axis = 0; axis < NUM_SWEEP_AXES; axis++) {
+			if (++index[axis] < sweep[axis].count)
+				break;
+			index[axis] = 0;
+		}
+		if (axis == NUM_SWEEP_AXES)
+			break;
+	}
+
+	stats_set_run(NULL);
+
+	return ret;
 }
 
 int main(int argc, char *argv[])
 {
 	const char *device = NULL;
-	const char *video = NULL;
-	const char *shadertoy = NULL;
-	const char *perfcntr = NULL;
+	const char *trace = NULL;
 	char mode_str[DRM_DISPLAY_MODE_LEN] = "";
 	char *p;
-	enum mode mode = SMOOTH;
-	uint32_t format = DRM_FORMAT_XRGB8888;
-	uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
-	int samples = 0;
+	struct run_config config = {
+		.mode = SMOOTH,
+		.format = DRM_FORMAT_XRGB8888,
+		.modifier = DRM_FORMAT_MOD_INVALID,
+		.num_buffers = DEFAULT_NUM_BUFFERS,
+	};
+	struct stats_config stats = {
+		.format = STATS_TEXT,
+	};
+	enum present_mode present = PRESENT_FIFO;
+	int64_t jit_margin_ns = -1;
 	int atomic = 0;
-	int opt;
+	int all_outputs = 0;
+	int offscreen = 0;
+	int opt, ret;
 	unsigned int len;
 	unsigned int vrefresh = 0;
 	unsigned int count = ~0;
-	bool surfaceless = false;
+	char *end;
 
 #ifdef HAVE_GST
 	gst_init(&argc, &argv);
@@ -112,61 +537,105 @@ int main(int argc, char *argv[])
 
 	while ((opt = getopt_long_only(argc, argv, shortopts, longopts, NULL)) != -1) {
 		switch (opt) {
+		case 'a':
+			all_outputs = 1;
+			break;
 		case 'A':
 			atomic = 1;
 			break;
+		case 'B':
+			if (add_sweep(optarg)) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'b':
+			if (parse_buffers(optarg, &config.num_buffers)) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
 		case 'c':
 			count = strtoul(optarg, NULL, 0);
 			break;
+		case 'C':
+			if (parse_stop_cv(optarg, &stats.stop_cv)) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
 		case 'D':
 			device = optarg;
 			break;
-		case 'f': {
-			char fourcc[4] = "    ";
-			int length = strlen(optarg);
-			if (length > 0)
-				fourcc[0] = optarg[0];
-			if (length > 1)
-				fourcc[1] = optarg[1];
-			if (length > 2)
-				fourcc[2] = optarg[2];
-			if (length > 3)
-				fourcc[3] = optarg[3];
-			format = fourcc_code(fourcc[0], fourcc[1],
-					     fourcc[2], fourcc[3]);
+		case 'F':
+			if (strcmp(optarg, "text") == 0) {
+				stats.format = STATS_TEXT;
+			} else if (strcmp(optarg, "json") == 0) {
+				stats.format = STATS_JSON;
+			} else if (strcmp(optarg, "csv") == 0) {
+				stats.format = STATS_CSV;
+			} else {
+				printf("invalid stats format: %s\n", optarg);
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'f':
+			config.format = parse_format(optarg);
+			break;
+		case 'J':
+			if (parse_jit_margin(optarg, &jit_margin_ns)) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'k':
+			init_probe_cache();
+			break;
+		case 'L':
+			config.video_plane = true;
 			break;
-		}
 		case 'M':
-			if (strcmp(optarg, "smooth") == 0) {
-				mode = SMOOTH;
-			} else if (strcmp(optarg, "rgba") == 0) {
-				mode = RGBA;
-			} else if (strcmp(optarg, "nv12-2img") == 0) {
-				mode = NV12_2IMG;
-			} else if (strcmp(optarg, "nv12-1img") == 0) {
-				mode = NV12_1IMG;
-			} else {
-				printf("invalid mode: %s\n", optarg);
+			if (parse_mode(optarg, &config.mode)) {
 				usage(argv[0]);
 				return -1;
 			}
 			break;
 		case 'm':
-			modifier = strtoull(optarg, NULL, 0);
+			config.modifier = strtoull(optarg, NULL, 0);
+			break;
+		case 'O':
+			offscreen = 1;
+			break;
+		case 'P':
+			if (strcmp(optarg, "fifo") == 0) {
+				present = PRESENT_FIFO;
+			} else if (strcmp(optarg, "mailbox") == 0) {
+				present = PRESENT_MAILBOX;
+			} else if (strcmp(optarg, "async") == 0) {
+				present = PRESENT_ASYNC;
+			} else {
+				printf("invalid present mode: %s\n", optarg);
+				usage(argv[0]);
+				return -1;
+			}
 			break;
 		case 'p':
-			perfcntr = optarg;
+			config.perfcntr = optarg;
 			break;
 		case 'S':
-			mode = SHADERTOY;
-			shadertoy = optarg;
+			config.mode = SHADERTOY;
+			config.shadertoy = optarg;
 			break;
 		case 's':
-			samples = strtoul(optarg, NULL, 0);
+			config.samples = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			trace = optarg;
 			break;
 		case 'V':
-			mode = VIDEO;
-			video = optarg;
+			config.mode = VIDEO;
+			config.video = optarg;
 			break;
 		case 'v':
 			p = strchr(optarg, '-');
@@ -181,8 +650,22 @@ int main(int argc, char *argv[])
 			strncpy(mode_str, optarg, len);
 			mode_str[len] = '\0';
 			break;
+		case 'w': {
+			double warmup = strtod(optarg, &end);
+
+			if (warmup < 0 || (*end && strcmp(end, "s"))) {
+				printf("invalid warmup: %s\n", optarg);
+				usage(argv[0]);
+				return -1;
+			}
+			if (*end)
+				stats.warmup_ns = warmup * NSEC_PER_SEC;
+			else
+				stats.warmup_frames = warmup;
+			break;
+		}
 		case 'x':
-			surfaceless = true;
+			config.surfaceless = true;
 			break;
 		default:
 			usage(argv[0]);
@@ -190,47 +673,110 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (atomic)
-		drm = init_drm_atomic(device, mode_str, vrefresh, count);
-	else
-		drm = init_drm_legacy(device, mode_str, vrefresh, count);
-	if (!drm) {
-		printf("failed to initialize %s DRM\n", atomic ? "atomic" : "legacy");
+	/* there is no vblank to render just in time for otherwise: */
+	if (jit_margin_ns >= 0 && present != PRESENT_FIFO) {
+		printf("just in time rendering requires fifo presentation\n");
 		return -1;
 	}
 
-	gbm = init_gbm(drm->fd, drm->mode->hdisplay, drm->mode->vdisplay,
-			format, modifier, surfaceless);
-	if (!gbm) {
-		printf("failed to initialize GBM\n");
+	/* nor without a display: */
+	if (jit_margin_ns >= 0 && offscreen) {
+		printf("just in time rendering can't be combined with --offscreen\n");
 		return -1;
 	}
 
-	if (mode == SMOOTH)
-		egl = init_cube_smooth(gbm, samples);
-	else if (mode == VIDEO)
-		egl = init_cube_video(gbm, video, samples);
-	else if (mode == SHADERTOY)
-		egl = init_cube_shadertoy(gbm, shadertoy, samples);
-	else
-		egl = init_cube_tex(gbm, mode, samples);
+	if (all_outputs && (!atomic || offscreen)) {
+		printf("driving all outputs requires atomic modesetting\n");
+		return -1;
+	}
 
-	if (!egl) {
-		printf("failed to initialize EGL\n");
+	if (config.video_plane) {
+		if (!atomic || offscreen || config.mode != VIDEO) {
+			printf("video plane requires atomic modesetting and a video\n");
+			return -1;
+		}
+		/* the video has to show through the cube's background: */
+		uint32_t format = alpha_format(config.format);
+		if (!format) {
+			printf("video plane needs a format with an alpha channel\n");
+			return -1;
+		}
+		if (format != config.format) {
+			printf("video plane needs an alpha channel, using %c%c%c%c\n",
+					format & 0xff, (format >> 8) & 0xff,
+					(format >> 16) & 0xff, format >> 24);
+			config.format = format;
+		}
+	}
+
+	if (present == PRESENT_MAILBOX && (!atomic || offscreen)) {
+		printf("mailbox presentation requires atomic modesetting\n");
 		return -1;
 	}
 
-	if (perfcntr) {
-		if (mode != SHADERTOY) {
-			printf("performance counters only supported in shadertoy mode\n");
+	if (sweeping()) {
+		/* check the values up front, rather than after a few runs: */
+		for (unsigned axis = 0; axis < NUM_SWEEP_AXES; axis++) {
+			for (unsigned i = 0; i < sweep[axis].count; i++) {
+				struct run_config check = config;
+
+				if (set_sweep_value(&check, axis, sweep[axis].values[i]))
+					return -1;
+			}
+		}
+
+		/* the runs each tear down their egl and gbm, which the video
+		 * decoder and additional outputs hold on to:
+		 */
+		if (config.mode == VIDEO || config.perfcntr || all_outputs) {
+			printf("--sweep can't be combined with --video, --perfcntr or --all-outputs\n");
+			return -1;
+		}
+
+		/* the config of each run goes in its JSON record: */
+		if (stats.format == STATS_CSV) {
+			printf("--sweep reports in JSON, it can't be combined with --stats=csv\n");
 			return -1;
 		}
-		init_perfcntrs(egl, perfcntr);
+		stats.format = STATS_JSON;
+
+		/* every run measures the same number of frames, however long
+		 * the warmup takes:
+		 */
+		if (!stats.warmup_frames && !stats.warmup_ns)
+			stats.warmup_frames = SWEEP_WARMUP_FRAMES;
+		stats.frames = count == ~0u ? SWEEP_DEFAULT_FRAMES : count;
+		count = ~0;
 	}
 
-	/* clear the color buffer */
-	glClearColor(0.5, 0.5, 0.5, 1.0);
-	glClear(GL_COLOR_BUFFER_BIT);
+	init_startup();
 
-	return drm->run(gbm, egl);
+	if (trace)
+		init_trace(trace);
+
+	if (offscreen)
+		drm = init_drm_offscreen(device, mode_str, vrefresh, count);
+	else if (atomic)
+		drm = init_drm_atomic(device, mode_str, vrefresh, count, present,
+				jit_margin_ns, all_outputs);
+	else
+		drm = init_drm_legacy(device, mode_str, vrefresh, count, present,
+				jit_margin_ns);
+	if (!drm) {
+		printf("failed to initialize %s DRM\n",
+				offscreen ? "offscreen" : atomic ? "atomic" : "legacy");
+		finish_trace();
+		return -1;
+	}
+
+	init_stats(&stats);
+
+	if (sweeping())
+		ret = run_sweep(&config);
+	else
+		ret = run(&config);
+
+	finish_trace();
+
+	return ret;
 }
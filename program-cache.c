@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2020 The kmscube authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/* Module to cache linked programs on disk, using GL_OES_get_program_binary.
+ *
+ * create_program() looks up a binary keyed on a hash of the shader
+ * sources and the GL renderer and version strings (so a driver update
+ * or a different GPU misses), and if the driver accepts it, returns a
+ * program that link_program() doesn't need to link.  Otherwise the
+ * shaders are compiled as usual, and the binary of the linked program
+ * stored for next time.
+ *
+ * Binaries live in $XDG_CACHE_HOME/kmscube (or ~/.cache/kmscube), one
+ * file per program, holding the binary format followed by the binary.
+ */
+
+#define MAX_PROGRAMS 32
+
+static struct {
+	bool enabled;
+	char dir[PATH_MAX];
+	uint64_t seed;          /* hash of the renderer and version */
+
+	PFNGLGETPROGRAMBINARYOESPROC glGetProgramBinaryOES;
+	PFNGLPROGRAMBINARYOESPROC glProgramBinaryOES;
+
+	/* the key of each program created, until it is linked: */
+	struct {
+		GLuint program;
+		uint64_t key;
+		bool loaded;
+	} programs[MAX_PROGRAMS];
+	unsigned num_programs;
+
+	unsigned hits, misses;
+	int64_t time_ns;        /* spent creating and linking programs */
+	bool parallel;          /* GL_KHR_parallel_shader_compile */
+} cache;
+
+/* FNV-1a, including the terminating NUL so "ab"+"c" != "a"+"bc": */
+static uint64_t hash_string(uint64_t hash, const char *str)
+{
+	do {
+		hash ^= (uint8_t)*str;
+		hash *= UINT64_C(0x100000001b3);
+	} while (*str++);
+
+	return hash;
+}
+
+void init_program_cache(const struct egl *egl)
+{
+	const char *dir;
+	GLint num_formats = 0;
+
+	memset(&cache, 0, sizeof(cache));
+	cache.parallel = egl->glMaxShaderCompilerThreadsKHR != NULL;
+
+	if (!egl->glGetProgramBinaryOES || !egl->glProgramBinaryOES)
+		return;
+
+	/* the extension may be exposed without any format to use: */
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &num_formats);
+	if (num_formats <= 0)
+		return;
+
+	dir = get_cache_dir();
+	if (!dir)
+		return;
+	snprintf(cache.dir, sizeof(cache.dir), "%s", dir);
+
+	cache.seed = hash_string(UINT64_C(0xcbf29ce484222325),
+			(const char *)glGetString(GL_RENDERER));
+	cache.seed = hash_string(cache.seed, (const char *)glGetString(GL_VERSION));
+	cache.glGetProgramBinaryOES = egl->glGetProgramBinaryOES;
+	cache.glProgramBinaryOES = egl->glProgramBinaryOES;
+	cache.enabled = true;
+}
+
+static void cache_path(char *path, size_t size, uint64_t key)
+{
+	snprintf(path, size, "%s/%016" PRIx64 ".bin", cache.dir, key);
+}
+
+static void *read_file(const char *path, long *size)
+{
+	FILE *f = fopen(path, "rb");
+	void *data = NULL;
+
+	if (!f)
+		return NULL;
+
+	if (fseek(f, 0, SEEK_END) == 0 && (*size = ftell(f)) > 0 &&
+	    fseek(f, 0, SEEK_SET) == 0) {
+		data = malloc(*size);
+		if (data && fread(data, 1, *size, f) != (size_t)*size) {
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+
+	return data;
+}
+
+static void remember(GLuint program, uint64_t key, bool loaded)
+{
+	unsigned n = cache.num_programs++ % MAX_PROGRAMS;
+
+	cache.programs[n].program = program;
+	cache.programs[n].key = key;
+	cache.programs[n].loaded = loaded;
+}
+
+/* Returns a linked program for the sources from the cache, or 0: */
+GLuint program_cache_load(const char *vs_src, const char *fs_src)
+{
+	char path[PATH_MAX];
+	GLuint program;
+	GLint status = 0;
+	uint64_t key;
+	GLenum format;
+	char *data;
+	long size;
+
+	if (!cache.enabled)
+		return 0;
+
+	key = hash_string(hash_string(cache.seed, vs_src), fs_src);
+	cache_path(path, sizeof(path), key);
+
+	data = read_file(path, &size);
+	if (data && size > (long)sizeof(format)) {
+		memcpy(&format, data, sizeof(format));
+		program = glCreateProgram();
+		cache.glProgramBinaryOES(program, format, data + sizeof(format),
+				size - sizeof(format));
+		glGetProgramiv(program, GL_LINK_STATUS, &status);
+		if (status) {
+			free(data);
+			remember(program, key, true);
+			cache.hits++;
+			return program;
+		}
+		/* from an older driver that didn't change its version: */
+		glDeleteProgram(program);
+	}
+	free(data);
+
+	/* link_program() stores it under this key: */
+	remember(0, key, false);
+	cache.misses++;
+
+	return 0;
+}
+
+/* Called with the program that the last miss compiled: */
+void program_cache_created(GLuint program)
+{
+	if (cache.enabled && cache.num_programs)
+		cache.programs[(cache.num_programs - 1) % MAX_PROGRAMS].program = program;
+}
+
+static int find_program(GLuint program)
+{
+	for (unsigned i = 0; i < MIN2(cache.num_programs, MAX_PROGRAMS); i++) {
+		unsigned n = (cache.num_programs - 1 - i) % MAX_PROGRAMS;
+
+		if (cache.programs[n].program == program)
+			return n;
+	}
+	return -1;
+}
+
+/* Whether the program came from the cache, already linked: */
+bool program_cache_loaded(GLuint program)
+{
+	int n = find_program(program);
+
+	return n >= 0 && cache.programs[n].loaded;
+}
+
+void program_cache_store(GLuint program)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	GLint length = 0;
+	GLenum format;
+	void *binary;
+	FILE *f;
+	int n;
+
+	n = find_program(program);
+	if (n < 0 || cache.programs[n].loaded)
+		return;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	binary = malloc(length);
+	if (!binary)
+		return;
+	cache.glGetProgramBinaryOES(program, length, &length, &format, binary);
+
+	/* write it under a temporary name, so a concurrent run never reads
+	 * half a binary:
+	 */
+	cache_path(path, sizeof(path), cache.programs[n].key);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	f = fopen(tmp, "wb");
+	if (f) {
+		bool ok = fwrite(&format, sizeof(format), 1, f) == 1 &&
+			fwrite(binary, length, 1, f) == 1;
+
+		if (fclose(f) == 0 && ok)
+			rename(tmp, path);
+		else
+			unlink(tmp);
+	}
+	free(binary);
+
+	cache.programs[n].program = 0;
+}
+
+void program_cache_time(int64_t ns)
+{
+	cache.time_ns += ns;
+}
+
+void program_cache_report(void)
+{
+	if (cache.enabled)
+		printf("Program cache: %u hits, %u misses, ", cache.hits, cache.misses);
+	else
+		printf("Program cache: unavailable, ");
+	printf("%.1f ms creating programs (%s compile)\n",
+		(double)cache.time_ns / (NSEC_PER_SEC / MSEC_PER_SEC),
+		cache.parallel ? "parallel" : "serial");
+}
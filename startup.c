@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2020 The kmscube authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+
+#include "common.h"
+
+/* Module to time the phases of startup, up to the first frame on screen.
+ *
+ * Once init_startup() is called, each startup_phase() ends the phase
+ * that began with the previous one (or with init_startup()), and
+ * startup_report() prints them all, once.  The phases also show up in
+ * the trace, if there is one.
+ *
+ * Phase names must be string literals (only the pointer is recorded).
+ */
+
+#define MAX_PHASES 16
+
+static struct {
+	bool enabled;
+	int64_t start_time, last_time;
+	struct {
+		const char *name;
+		int64_t duration;
+	} phases[MAX_PHASES];
+	unsigned num_phases;
+} startup;
+
+void init_startup(void)
+{
+	startup.enabled = true;
+	startup.start_time = startup.last_time = get_time_ns();
+}
+
+void startup_phase(const char *name)
+{
+	int64_t now;
+
+	if (!startup.enabled || startup.num_phases == MAX_PHASES)
+		return;
+
+	now = get_time_ns();
+	trace_span(name, startup.last_time, now);
+
+	startup.phases[startup.num_phases].name = name;
+	startup.phases[startup.num_phases].duration = now - startup.last_time;
+	startup.num_phases++;
+	startup.last_time = now;
+}
+
+void startup_report(void)
+{
+	if (!startup.enabled)
+		return;
+
+	printf("Startup:");
+	for (unsigned i = 0; i < startup.num_phases; i++) {
+		printf(" %s %.1f ms%s", startup.phases[i].name,
+			(double)startup.phases[i].duration / (NSEC_PER_SEC / MSEC_PER_SEC),
+			i + 1 < startup.num_phases ? "," : "");
+	}
+	printf("; total %.1f ms\n",
+		(double)(startup.last_time - startup.start_time) / (NSEC_PER_SEC / MSEC_PER_SEC));
+
+	/* later runs of a sweep don't start up again: */
+	startup.enabled = false;
+}
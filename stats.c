@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2020 The kmscube authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+/* Module to collect frame time statistics.
+ *
+ * Call stats_frame() each time a frame has been presented, and
+ * stats_report() to print percentiles of the frame intervals.  The
+ * measurement starts after the warmup given to init_stats() (at least
+ * the first frame, to not count shader compilation, etc).  Periodic
+ * reports cover the frames since the previous report, the final report
+ * covers the whole run.
+ *
+ * stats_done() tells the caller when to stop: after a fixed number of
+ * measured frames, or once the frame time has settled, that is when the
+ * coefficient of variation (standard deviation over mean) of the last
+ * STEADY_WINDOW frame times drops below a threshold.
+ *
+ * Frame intervals are recorded in a fixed size histogram with
+ * BUCKET_NS resolution, using atomic increments so that the histogram
+ * can be read (for reporting) while another thread is recording into it.
+ * The histogram only gives the percentiles; the mean and its confidence
+ * interval come from exact sums of the intervals, so that frames beyond
+ * its range (which all land in the overflow bucket) still count in full.
+ */
+
+#define BUCKET_NS    (10 * (NSEC_PER_SEC / USEC_PER_SEC))   /* 10us */
+#define NUM_BUCKETS  10000                                  /* 100ms */
+#define STEADY_WINDOW 120
+
+struct histogram {
+	uint32_t buckets[NUM_BUCKETS + 1];  /* last bucket is overflow */
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t sum_sq_us;                 /* in us^2, to not overflow */
+};
+
+struct stats {
+	const char *name;
+	int64_t refresh_ns;      /* 0 if there is no vblank to miss */
+
+	int64_t first_time, start_time, last_time;
+	unsigned warmup_left;
+	bool started;
+
+	/* the last frame intervals, for the steady state check: */
+	int64_t window[STEADY_WINDOW];
+	unsigned window_count;
+	bool steady;
+
+	/* total, and a snapshot of it at the time of the last report: */
+	struct histogram hist, snapshot;
+	int64_t max_ns, window_max_ns;
+	uint64_t missed;
+	bool exact_missed;       /* counted by the caller, see stats_missed() */
+};
+
+static struct stats_config config = {
+	.format = STATS_TEXT,
+	.warmup_frames = 1,
+};
+
+/* JSON members describing the run, see stats_set_run(): */
+static char run_fields[256];
+
+void init_stats(const struct stats_config *c)
+{
+	config = *c;
+	config.warmup_frames = MAX2(config.warmup_frames, 1);
+
+	if (config.format == STATS_CSV)
+		printf("name,final,frames,secs,fps,avg_ms,ci95_ms,p50_ms,p90_ms,p99_ms,p99.9_ms,max_ms,missed_vblanks,steady\n");
+}
+
+/* Describe the configuration of a run of a sweep, as a list of JSON
+ * members added to its reports (or NULL when done).  Runs only report
+ * once, at the end:
+ */
+void stats_set_run(const char *fields)
+{
+	snprintf(run_fields, sizeof(run_fields), "%s", fields ? fields : "");
+}
+
+struct stats * stats_new(const char *name, unsigned vrefresh)
+{
+	struct stats *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return NULL;
+
+	s->name = name;
+	s->warmup_left = config.warmup_frames;
+	if (vrefresh)
+		s->refresh_ns = NSEC_PER_SEC / vrefresh;
+
+	return s;
+}
+
+void stats_free(struct stats *s)
+{
+	free(s);
+}
+
+/* coefficient of variation of the last STEADY_WINDOW frame times: */
+static double window_cv(const struct stats *s)
+{
+	double sum = 0, mean, var = 0;
+
+	for (unsigned i = 0; i < STEADY_WINDOW; i++)
+		sum += s->window[i];
+	mean = sum / STEADY_WINDOW;
+
+	for (unsigned i = 0; i < STEADY_WINDOW; i++)
+		var += (s->window[i] - mean) * (s->window[i] - mean);
+	var /= STEADY_WINDOW - 1;
+
+	return mean > 0 ? sqrt(var) / mean : 0.0;
+}
+
+static void stats_start(struct stats *s, int64_t time_ns)
+{
+	const char *name = s->name;
+	int64_t refresh_ns = s->refresh_ns;
+	bool exact_missed = s->exact_missed;
+
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	s->refresh_ns = refresh_ns;
+	s->exact_missed = exact_missed;
+	s->start_time = s->last_time = time_ns;
+	s->started = true;
+}
+
+void stats_frame(struct stats *s, int64_t time_ns)
+{
+	int64_t interval;
+	uint64_t us;
+	unsigned bucket;
+
+	if (!s->started) {
+		if (!s->first_time)
+			s->first_time = time_ns;
+		if (s->warmup_left)
+			s->warmup_left--;
+		if (!s->warmup_left && time_ns - s->first_time >= config.warmup_ns)
+			stats_start(s, time_ns);
+		return;
+	}
+
+	interval = time_ns - s->last_time;
+	s->last_time = time_ns;
+
+	bucket = MIN2(interval / BUCKET_NS, NUM_BUCKETS);
+	us = (interval + 500) / 1000;
+	__atomic_fetch_add(&s->hist.buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->hist.sum_ns, interval, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->hist.sum_sq_us, us * us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->hist.count, 1, __ATOMIC_RELEASE);
+
+	if (interval > __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED))
+		__atomic_store_n(&s->max_ns, interval, __ATOMIC_RELAXED);
+	if (interval > __atomic_load_n(&s->window_max_ns, __ATOMIC_RELAXED))
+		__atomic_store_n(&s->window_max_ns, interval, __ATOMIC_RELAXED);
+
+	/* Anything more than half a refresh late means at least one vblank
+	 * went by without a new frame:
+	 */
+	if (!s->exact_missed && s->refresh_ns &&
+	    interval > s->refresh_ns + s->refresh_ns / 2) {
+		uint64_t n = (interval + s->refresh_ns / 2) / s->refresh_ns - 1;
+		__atomic_fetch_add(&s->missed, n, __ATOMIC_RELAXED);
+	}
+
+	s->window[s->window_count++ % STEADY_WINDOW] = interval;
+	if (config.stop_cv > 0 && s->window_count >= STEADY_WINDOW)
+		s->steady = window_cv(s) < config.stop_cv;
+}
+
+/* Count missed vblanks the caller knows about (ie. from the vblank
+ * sequence numbers of the flips), instead of guessing them from the
+ * frame intervals.  Call it for every frame, before stats_frame().
+ */
+void stats_missed(struct stats *s, unsigned n)
+{
+	s->exact_missed = true;
+
+	if (s->started)
+		__atomic_fetch_add(&s->missed, n, __ATOMIC_RELAXED);
+}
+
+bool stats_done(const struct stats *s)
+{
+	return s->steady || (config.frames &&
+		__atomic_load_n(&s->hist.count, __ATOMIC_RELAXED) >= config.frames);
+}
+
+unsigned stats_frames(const struct stats *s)
+{
+	return __atomic_load_n(&s->hist.count, __ATOMIC_ACQUIRE);
+}
+
+/* value (in ms) below which the given fraction of samples lie, 0 if
+ * there are none, or -1 if it is beyond the range of the histogram:
+ */
+static double percentile(const uint32_t *buckets, uint64_t count, double fraction)
+{
+	uint64_t target = fraction * count, sum = 0;
+	unsigned i;
+
+	if (!count)
+		return 0.0;
+
+	for (i = 0; i <= NUM_BUCKETS; i++) {
+		sum += buckets[i];
+		if (sum > target)
+			break;
+	}
+
+	if (i >= NUM_BUCKETS)
+		return -1.0;
+
+	return (double)((i + 1) * BUCKET_NS) / (NSEC_PER_SEC / MSEC_PER_SEC);
+}
+
+/* Format a percentile, which beyond the histogram is only known to be
+ * above its range (and so is null in JSON):
+ */
+static const char *format_percentile(char *buf, size_t size,
+		const struct histogram *h, double fraction)
+{
+	double ms = percentile(h->buckets, h->count, fraction);
+
+	if (ms >= 0)
+		snprintf(buf, size, "%.3f", ms);
+	else if (config.format == STATS_JSON)
+		snprintf(buf, size, "null");
+	else
+		snprintf(buf, size, ">%d", (int)(NUM_BUCKETS * BUCKET_NS /
+				(NSEC_PER_SEC / MSEC_PER_SEC)));
+
+	return buf;
+}
+
+/* mean frame time (in ms), or 0 if there are no samples: */
+static double mean(const struct histogram *h)
+{
+	if (!h->count)
+		return 0.0;
+
+	return (double)h->sum_ns / h->count / (NSEC_PER_SEC / MSEC_PER_SEC);
+}
+
+/* Half width (in ms) of the 95% confidence interval of the mean frame
+ * time, treating the samples as independent:
+ */
+static double confidence95(const struct histogram *h)
+{
+	double avg_us, var;
+
+	if (h->count < 2)
+		return 0.0;
+
+	avg_us = mean(h) * USEC_PER_SEC / MSEC_PER_SEC;
+	var = MAX2((double)h->sum_sq_us / h->count - avg_us * avg_us, 0.0) *
+			h->count / (h->count - 1);
+
+	return 1.96 * sqrt(var / h->count) / (USEC_PER_SEC / MSEC_PER_SEC);
+}
+
+void stats_report(struct stats *s, int64_t time_ns, bool final)
+{
+	struct histogram total, window;
+	const struct histogram *hist = &total;
+	uint64_t count, missed;
+	int64_t max_ns, elapsed;
+	double secs, avg, ci, max;
+	char p50[16], p90[16], p99[16], p999[16];
+
+	if (!s->started || (run_fields[0] && !final))
+		return;
+
+	count = total.count = __atomic_load_n(&s->hist.count, __ATOMIC_ACQUIRE);
+	for (unsigned i = 0; i <= NUM_BUCKETS; i++)
+		total.buckets[i] = __atomic_load_n(&s->hist.buckets[i], __ATOMIC_RELAXED);
+	total.sum_ns = __atomic_load_n(&s->hist.sum_ns, __ATOMIC_RELAXED);
+	total.sum_sq_us = __atomic_load_n(&s->hist.sum_sq_us, __ATOMIC_RELAXED);
+	missed = __atomic_load_n(&s->missed, __ATOMIC_RELAXED);
+	max_ns = __atomic_exchange_n(&s->window_max_ns, 0, __ATOMIC_RELAXED);
+
+	/* the fps figure is always for the whole run, so it can be compared
+	 * with the output of older versions:
+	 */
+	elapsed = time_ns - s->start_time;
+	secs = (double)elapsed / NSEC_PER_SEC;
+
+	if (final) {
+		max_ns = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+	} else {
+		for (unsigned i = 0; i <= NUM_BUCKETS; i++)
+			window.buckets[i] = total.buckets[i] - s->snapshot.buckets[i];
+		window.count = total.count - s->snapshot.count;
+		window.sum_ns = total.sum_ns - s->snapshot.sum_ns;
+		window.sum_sq_us = total.sum_sq_us - s->snapshot.sum_sq_us;
+		hist = &window;
+
+		s->snapshot = total;
+	}
+
+	format_percentile(p50, sizeof(p50), hist, 0.5);
+	format_percentile(p90, sizeof(p90), hist, 0.9);
+	format_percentile(p99, sizeof(p99), hist, 0.99);
+	format_percentile(p999, sizeof(p999), hist, 0.999);
+	avg = mean(hist);
+	ci = confidence95(hist);
+
+	max = (double)max_ns / (NSEC_PER_SEC / MSEC_PER_SEC);
+
+	switch (config.format) {
+	case STATS_TEXT:
+		printf("Rendered %u frames in %f sec (%f fps)\n",
+			(unsigned)count, secs, (double)count/secs);
+		printf("  %s frame time (ms): avg %.3f (95%% CI +/-%.3f)  p50 %s  p90 %s  p99 %s  p99.9 %s  max %.3f",
+			final ? "total" : "last period", avg, ci, p50, p90,
+			p99, p999, max);
+		if (s->refresh_ns)
+			printf("  missed vblanks: %" PRIu64, missed);
+		printf("\n");
+		if (final && s->steady)
+			printf("  stopped at steady state (frame time CV below %.2f%%)\n",
+				config.stop_cv * 100);
+		break;
+	case STATS_JSON:
+		printf("{\"name\": \"%s\", %s%s\"final\": %s, \"frames\": %" PRIu64 ", "
+			"\"secs\": %f, \"fps\": %f, \"avg_ms\": %.3f, \"ci95_ms\": %.3f, "
+			"\"p50_ms\": %s, \"p90_ms\": %s, \"p99_ms\": %s, "
+			"\"p99.9_ms\": %s, \"max_ms\": %.3f, \"missed_vblanks\": %" PRIu64 ", "
+			"\"steady\": %s}\n",
+			s->name, run_fields, run_fields[0] ? ", " : "",
+			final ? "true" : "false", count, secs,
+			(double)count/secs, avg, ci, p50, p90, p99, p999,
+			max, missed,
+			s->steady ? "true" : "false");
+		break;
+	case STATS_CSV:
+		printf("%s,%d,%" PRIu64 ",%f,%f,%.3f,%.3f,%s,%s,%s,%s,%.3f,%" PRIu64 ",%d\n",
+			s->name, final, count, secs, (double)count/secs,
+			avg, ci, p50, p90, p99, p999, max, missed, s->steady);
+		break;
+	}
+
+	fflush(stdout);
+}
+
+int64_t stats_elapsed(const struct stats *s, int64_t time_ns)
+{
+	return s->started ? time_ns - s->start_time : 0;
+}
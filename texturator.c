@@ -950,14 +950,15 @@ int main(int argc, char *argv[])
 	print_summary();
 
 	/* no real need for atomic here: */
-	drm = init_drm_legacy(device, mode_str, vrefresh, ~0);
+	drm = init_drm_legacy(device, mode_str, vrefresh, ~0, PRESENT_FIFO, -1);
 	if (!drm) {
 		printf("failed to initialize DRM\n");
 		return -1;
 	}
 
 	gbm = init_gbm(drm->fd, drm->mode->hdisplay, drm->mode->vdisplay,
-			DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR, false);
+			DRM_FORMAT_XRGB8888, (uint64_t[]){ DRM_FORMAT_MOD_LINEAR }, 1,
+			false, true, DEFAULT_NUM_BUFFERS);
 	if (!gbm) {
 		printf("failed to initialize GBM\n");
 		return -1;
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2020 The kmscube authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/* Module to record a timeline of the frame loop, written out in the
+ * Chrome trace event format (load it in chrome://tracing or Perfetto).
+ *
+ * Wrap the phase to measure with:
+ *
+ *    int64_t t = trace_begin();
+ *    ...
+ *    trace_end("phase", t);
+ *
+ * or use trace_span() when both timestamps are already known.  Spans are
+ * stored in a preallocated per-thread ring buffer, so recording one is a
+ * clock read plus a couple of stores; when the ring fills up the oldest
+ * spans are overwritten.  Nothing is written until finish_trace().
+ *
+ * The ring of the thread calling init_trace() is set up right away, other
+ * threads should call init_trace_thread() when they start, so that the
+ * allocation (and faulting in its pages) isn't recorded in the middle of
+ * whatever they measure.
+ *
+ * Span names must be string literals (only the pointer is recorded).
+ */
+
+#define RING_SIZE (64 * 1024)   /* spans per thread */
+
+struct span {
+	const char *name;
+	int64_t begin, end;
+};
+
+struct ring {
+	struct ring *next;
+	pid_t tid;
+	uint64_t head;          /* total number of spans recorded */
+	struct span spans[RING_SIZE];
+};
+
+static struct {
+	FILE *file;
+	bool enabled;
+	pthread_mutex_t lock;   /* protects the list of rings */
+	struct ring *rings;
+} trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct ring *ring;
+
+void init_trace(const char *filename)
+{
+	trace.file = fopen(filename, "w");
+	if (!trace.file) {
+		printf("could not open trace file '%s'\n", filename);
+		return;
+	}
+
+	trace.enabled = true;
+
+	init_trace_thread();
+}
+
+static struct ring * get_ring(void)
+{
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	/* touch every page now, rather than as spans are recorded: */
+	memset(ring->spans, 0, sizeof(ring->spans));
+
+	ring->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&trace.lock);
+	ring->next = trace.rings;
+	trace.rings = ring;
+	pthread_mutex_unlock(&trace.lock);
+
+	return ring;
+}
+
+void init_trace_thread(void)
+{
+	if (trace.enabled)
+		get_ring();
+}
+
+int64_t trace_begin(void)
+{
+	if (!trace.enabled)
+		return 0;
+
+	return get_time_ns();
+}
+
+void trace_span(const char *name, int64_t begin, int64_t end)
+{
+	struct ring *r;
+	struct span *s;
+
+	if (!trace.enabled || !begin)
+		return;
+
+	r = get_ring();
+	if (!r)
+		return;
+
+	s = &r->spans[r->head % RING_SIZE];
+	s->name = name;
+	s->begin = begin;
+	s->end = end;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_end(const char *name, int64_t begin)
+{
+	if (!trace.enabled || !begin)
+		return;
+
+	trace_span(name, begin, get_time_ns());
+}
+
+void finish_trace(void)
+{
+	const char *sep = "";
+	pid_t pid = getpid();
+
+	if (!trace.enabled)
+		return;
+
+	trace.enabled = false;
+
+	fprintf(trace.file, "{\"traceEvents\": [\n");
+
+	pthread_mutex_lock(&trace.lock);
+	for (struct ring *r = trace.rings; r; r = r->next) {
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint64_t first = head > RING_SIZE ? head - RING_SIZE : 0;
+
+		for (uint64_t n = first; n < head; n++) {
+			const struct span *s = &r->spans[n % RING_SIZE];
+
+			/* timestamps are in microseconds: */
+			fprintf(trace.file, "%s{\"name\": \"%s\", \"ph\": \"X\", "
+				"\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d}",
+				sep, s->name, (double)s->begin / 1000.0,
+				(double)(s->end - s->begin) / 1000.0, pid, r->tid);
+			sep = ",\n";
+		}
+	}
+	pthread_mutex_unlock(&trace.lock);
+
+	fprintf(trace.file, "\n], \"displayTimeUnit\": \"ms\"}\n");
+	fclose(trace.file);
+	trace.file = NULL;
+}
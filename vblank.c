@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2020 The kmscube authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "drm-common.h"
+
+/* Module to detect missed vblanks from the vblank sequence numbers of
+ * consecutive flips, and to work out which phase of the frame loop made
+ * each one late.
+ *
+ * A flip that lands more than one vblank after the previous one should
+ * have hit the vblank right after it.  That vblank is its deadline, and
+ * the first phase of the frame that ended after the deadline is blamed
+ * for the miss: the cpu drawing it, the gpu rendering it, or the commit
+ * (or page flip) being queued too late.
+ */
+
+static const char *phase_names[] = {
+	[PHASE_DRAW]   = "draw",
+	[PHASE_GPU]    = "gpu",
+	[PHASE_COMMIT] = "commit",
+};
+
+struct vblank {
+	int64_t refresh_ns;
+
+	bool have_last;
+	unsigned last_sequence;
+	int64_t last_time;
+
+	uint64_t missed[ARRAY_SIZE(phase_names)];
+};
+
+struct vblank * vblank_new(const drmModeModeInfo *mode)
+{
+	struct vblank *v = calloc(1, sizeof(*v));
+
+	if (!v)
+		return NULL;
+
+	v->refresh_ns = mode_refresh_ns(mode);
+
+	return v;
+}
+
+void vblank_free(struct vblank *v)
+{
+	free(v);
+}
+
+static enum frame_phase late_phase(const struct frame_times *ft, int64_t deadline,
+		int64_t *late_ns)
+{
+	if (ft->draw_done > deadline) {
+		*late_ns = ft->draw_done - deadline;
+		return PHASE_DRAW;
+	}
+
+	/* zero if the gpu completion time is not known: */
+	if (ft->gpu_done > deadline) {
+		*late_ns = ft->gpu_done - deadline;
+		return PHASE_GPU;
+	}
+
+	*late_ns = MAX2(ft->commit - deadline, 0);
+	return PHASE_COMMIT;
+}
+
+unsigned vblank_flip(struct vblank *v, unsigned sequence, int64_t time_ns,
+		const struct frame_times *ft)
+{
+	unsigned gap = sequence - v->last_sequence;
+	int64_t deadline = v->last_time + v->refresh_ns;
+	bool have_last = v->have_last;
+	enum frame_phase phase;
+	int64_t late_ns;
+
+	v->have_last = true;
+	v->last_sequence = sequence;
+	v->last_time = time_ns;
+
+	if (!have_last || gap <= 1)
+		return 0;
+
+	phase = late_phase(ft, deadline, &late_ns);
+	v->missed[phase] += gap - 1;
+
+	printf("frame %u: missed %u vblank%s, %s late by %.3f ms\n",
+		ft->frame, gap - 1, gap > 2 ? "s" : "", phase_names[phase],
+		(double)late_ns / (NSEC_PER_SEC / MSEC_PER_SEC));
+
+	return gap - 1;
+}
+
+void vblank_report(const struct vblank *v)
+{
+	uint64_t total = 0;
+
+	for (unsigned p = 0; p < ARRAY_SIZE(v->missed); p++)
+		total += v->missed[p];
+
+	if (!total)
+		return;
+
+	printf("Missed vblanks by phase:");
+	for (unsigned p = 0; p < ARRAY_SIZE(v->missed); p++)
+		printf(" %s %" PRIu64, phase_names[p], v->missed[p]);
+	printf("\n");
+}